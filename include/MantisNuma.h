@@ -0,0 +1,30 @@
+//
+// Mantis : An efficient large-scale sequence search index
+// Copyright (C) 2017 Prahsant Pandey, Fatemeh Almodaresi, Michael Bender, Michael Ferdman,
+// Rob Johnson, Rob Patro
+//
+// This file is part of Mantis.
+//
+
+#ifndef __MANTIS_NUMA_HPP__
+#define __MANTIS_NUMA_HPP__
+
+#include <vector>
+#include <string>
+#include <cstdint>
+
+namespace mantis {
+	namespace numa {
+		// The NUMA nodes with memory. Empty if the kernel has no NUMA support.
+		std::vector<uint32_t> Nodes();
+		// The memory the calling thread allocates from now on is spread page by
+		// page over nodes. Threads it starts afterwards inherit the policy.
+		bool InterleaveMemory(const std::vector<uint32_t>& nodes);
+		// The calling thread allocates on the node it runs on again.
+		bool LocalMemory();
+		// Runs the calling thread only on the CPUs of node.
+		bool PinToNode(uint32_t node);
+	}
+}
+
+#endif //__MANTIS_NUMA_HPP__
@@ -3,15 +3,25 @@
 #include <memory>
 #include "spdlog/spdlog.h"
 #include "json.hpp"
+#include "mantisconfig.hpp"
 
 
 class BuildOpts {
  public:
 	bool flush_eqclass_dist{false};
-	int qbits;
+	// 0 means the size is estimated from the inputs.
+	int qbits{0};
   std::string inlist;
   std::string out;
 	int numthreads{1};
+	bool no_restart{false};
+	uint32_t group_size{0};
+	// Memory budget in GB for the color class buffers. 0 means no budget.
+	uint64_t max_memory{0};
+	// Memory budget in GB for the whole build. 0 means no budget.
+	uint64_t mem_limit{0};
+	// Color classes per buffer. Set by build from max_memory.
+	uint64_t num_bv_buffer{mantis::NUM_BV_BUFFER};
   std::shared_ptr<spdlog::logger> console{nullptr};
 
   nlohmann::json to_json() {
@@ -21,6 +31,55 @@ class BuildOpts {
     j["input_list"] = inlist;
     j["output_dir"] = out;
     j["num_threads"] = numthreads;
+    j["no_restart"] = no_restart;
+    j["group_size"] = group_size;
+    j["max_memory"] = max_memory;
+    j["mem_limit"] = mem_limit;
+    j[mantis::NUM_BV_BUFFER_KEY] = num_bv_buffer;
+    return j;
+  }
+};
+
+class AddOpts {
+ public:
+  std::string prefix;
+  std::string inlist;
+  std::string out;
+	int numthreads{1};
+	bool no_restart{false};
+	uint64_t max_memory{0};
+  std::shared_ptr<spdlog::logger> console{nullptr};
+
+  nlohmann::json to_json() {
+    nlohmann::json j;
+    j["index_prefix"] = prefix;
+    j["input_list"] = inlist;
+    j["output_dir"] = out;
+    j["num_threads"] = numthreads;
+    j["no_restart"] = no_restart;
+    j["max_memory"] = max_memory;
+    return j;
+  }
+};
+
+class MergeOpts {
+ public:
+  std::string first_prefix;
+  std::string second_prefix;
+  std::string out;
+	int numthreads{1};
+	bool no_restart{false};
+	uint64_t max_memory{0};
+  std::shared_ptr<spdlog::logger> console{nullptr};
+
+  nlohmann::json to_json() {
+    nlohmann::json j;
+    j["first_index_prefix"] = first_prefix;
+    j["second_index_prefix"] = second_prefix;
+    j["output_dir"] = out;
+    j["num_threads"] = numthreads;
+    j["no_restart"] = no_restart;
+    j["max_memory"] = max_memory;
     return j;
   }
 };
@@ -38,6 +97,25 @@ class QueryOpts {
   bool use_colorclasses{false};
   bool keep_colorclasses{false};
   bool remove_colorClasses{false};
+  bool huge_pages{false};
+  bool numa{false};
+};
+
+class ServeOpts {
+ public:
+  std::string prefix;
+  // Exactly one of the two is set.
+  std::string socket_path;
+  uint16_t port{0};
+  uint64_t k = 0;
+  uint32_t numThreads = 1;
+  // Limits on a request, in MB and seconds. 0 means no limit.
+  uint64_t max_request{64};
+  uint32_t timeout{30};
+  bool use_json{false};
+  bool huge_pages{false};
+  bool numa{false};
+  std::shared_ptr<spdlog::logger> console{nullptr};
 };
 
 class ValidateOpts {
@@ -56,6 +134,12 @@ public:
     std::shared_ptr<spdlog::logger> console{nullptr};
 };
 
+class ReorderOpts {
+public:
+    std::string prefix;
+    std::shared_ptr<spdlog::logger> console{nullptr};
+};
+
 class StatsOpts {
 public:
     std::string prefix;
@@ -0,0 +1,114 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  colorclasses.h
+ *
+ *    Description:  Color class table that stores each class in the smallest
+ *                  of a dense, a delta-coded, and a run-length-coded form.
+ *
+ * ============================================================================
+ */
+
+#ifndef _COLOR_CLASSES_H_
+#define _COLOR_CLASSES_H_
+
+#include <iostream>
+#include <string>
+#include <algorithm>
+#include <cstdint>
+
+#include "sdsl/bit_vectors.hpp"
+
+/* A block of color classes, each a num_samples-bit vector. Class i starts at
+ * bit m_offsets[i] of m_data and is stored in one of three forms:
+ *
+ *   DENSE       the num_samples bits as is.
+ *   DELTA       the number of samples in the class followed by the gaps
+ *               between consecutive sample ids.
+ *   RUN_LENGTH  the lengths of the alternating runs of 0s and 1s, starting
+ *               with a (possibly empty) run of 0s.
+ *
+ * Numbers in the sparse forms are Elias-gamma coded. Decoding them takes time
+ * proportional to the number of samples (or runs) in the class.
+ */
+class HybridColorClasses {
+	public:
+		enum encoding { DENSE = 0, DELTA = 1, RUN_LENGTH = 2 };
+
+		HybridColorClasses() = default;
+		// rows holds the color classes back to back, num_samples bits each.
+		HybridColorClasses(const sdsl::bit_vector& rows, uint64_t num_samples);
+
+		uint64_t size(void) const { return m_encodings.size(); }
+		uint64_t num_samples(void) const { return m_num_samples; }
+		encoding get_encoding(uint64_t i) const {
+			return static_cast<encoding>(m_encodings[i]);
+		}
+		uint64_t count(encoding e) const;
+
+		/* Calls f(sample_id) for each sample in class i in increasing order. */
+		template <typename F>
+		void for_each_sample(uint64_t i, F f) const;
+		/* Writes class i in words. words must hold (num_samples + 63) / 64
+		 * words. */
+		void get_words(uint64_t i, uint64_t *words) const;
+
+		uint64_t serialize(std::ostream& out, sdsl::structure_tree_node* v =
+											 nullptr, std::string name = "") const;
+		void load(std::istream& in);
+
+	private:
+		static uint64_t gamma_length(uint64_t x) {
+			return 2 * sdsl::bits::hi(x) + 1;
+		}
+		void put_gamma(uint64_t& pos, uint64_t x);
+		uint64_t get_gamma(uint64_t& pos) const {
+			uint64_t n = sdsl::bits::lo(m_data.get_int(pos, 64));
+			pos += n + 1;
+			uint64_t x = (1ULL << n) | m_data.get_int(pos, n);
+			pos += n;
+			return x;
+		}
+
+		uint64_t m_num_samples{0};
+		sdsl::int_vector<2> m_encodings;
+		sdsl::int_vector<> m_offsets;
+		sdsl::bit_vector m_data;
+};
+
+template <typename F>
+void HybridColorClasses::for_each_sample(uint64_t i, F f) const {
+	uint64_t pos = m_offsets[i];
+	switch (get_encoding(i)) {
+		case DENSE:
+			for (uint64_t j = 0; j < m_num_samples; j += 64) {
+				uint64_t wrd = m_data.get_int(pos + j, std::min((uint64_t)64,
+																												m_num_samples - j));
+				for (; wrd; wrd &= wrd - 1)
+					f(j + sdsl::bits::lo(wrd));
+			}
+			break;
+		case DELTA: {
+			uint64_t num_ids = get_gamma(pos) - 1;
+			uint64_t id = -1;
+			for (uint64_t j = 0; j < num_ids; j++) {
+				id += get_gamma(pos);
+				f(id);
+			}
+			break;
+		}
+		case RUN_LENGTH: {
+			uint64_t id = get_gamma(pos) - 1;
+			while (id < m_num_samples) {
+				uint64_t end = id + get_gamma(pos);
+				for (; id < end; id++)
+					f(id);
+				if (id < m_num_samples)
+					id += get_gamma(pos);
+			}
+			break;
+		}
+	}
+}
+
+#endif
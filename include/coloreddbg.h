@@ -17,6 +17,10 @@
 #include <set>
 #include <unordered_set>
 #include <chrono>
+#include <thread>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
 
 #include <inttypes.h>
 
@@ -27,6 +31,8 @@
 #include "gqf/hashutil.h"
 #include "common_types.h"
 #include "mantisconfig.hpp"
+#include "loser_tree.h"
+#include "colorclasses.h"
 
 #define MANTIS_DBG_IN_MEMORY (0x01)
 #define MANTIS_DBG_ON_DISK (0x02)
@@ -50,14 +56,107 @@ using cdbg_bv_map_t = spp::sparse_hash_map<Key, Value, hash128>;
 using default_cdbg_bv_map_t = cdbg_bv_map_t<__uint128_t,
 			std::pair<uint64_t,uint64_t>>;
 
+// Heap bytes of an eq class table. The items plus, for every SPP_GROUP_SIZE
+// buckets, a pointer to the items and two bitmaps.
+inline uint64_t cdbg_bv_map_bytes(const default_cdbg_bv_map_t& map) {
+	return map.size() * sizeof(default_cdbg_bv_map_t::value_type) +
+		map.bucket_count() / SPP_GROUP_SIZE * (sizeof(void*) + SPP_GROUP_SIZE / 4);
+}
+
+// Eq class table used by the multi-threaded merge.
+// Eq classes are split into shards based on their hash and each shard has its
+// own lock. So merge threads only wait on each other when they look up eq
+// classes in the same shard. Ids are handed out from a single atomic counter.
+class sharded_cdbg_bv_map {
+	public:
+		sharded_cdbg_bv_map() : shards(NUM_SHARDS) {}
+
+		// move the eq classes from map. Ids in map must be 1 to map.size().
+		void load(default_cdbg_bv_map_t& map) {
+			for (auto& it : map)
+				shards[shard_id(it.first)].map.insert(it);
+			next_id = map.size() + 1;
+			map.clear();
+		}
+
+		// move all the eq classes back into map.
+		void unload(default_cdbg_bv_map_t& map) {
+			map.clear();
+			for (auto& shard : shards) {
+				for (auto& it : shard.map)
+					map.insert(it);
+				shard.map.clear();
+			}
+		}
+
+		// returns true if vec_hash is a new eq class. The id of the eq class is
+		// returned in eq_id.
+		bool add(const __uint128_t& vec_hash, uint64_t& eq_id) {
+			shard& s = shards[shard_id(vec_hash)];
+			std::lock_guard<std::mutex> guard(s.lock);
+			auto it = s.map.find(vec_hash);
+			if (it == s.map.end()) {
+				eq_id = next_id++;
+				s.map.emplace(std::piecewise_construct,
+											std::forward_as_tuple(vec_hash),
+											std::forward_as_tuple(eq_id, 1));
+				return true;
+			}
+			eq_id = it->second.first;
+			it->second.second += 1; // update the abundance.
+			return false;
+		}
+
+		uint64_t size(void) const { return next_id - 1; }
+
+		uint64_t size_in_bytes(void) {
+			uint64_t bytes = shards.capacity() * sizeof(shard);
+			for (auto& s : shards) {
+				std::lock_guard<std::mutex> guard(s.lock);
+				bytes += cdbg_bv_map_bytes(s.map);
+			}
+			return bytes;
+		}
+
+	private:
+		static constexpr uint32_t NUM_SHARDS = 1024;
+
+		struct alignas(64) shard {
+			std::mutex lock;
+			default_cdbg_bv_map_t map;
+		};
+
+		uint32_t shard_id(const __uint128_t& vec_hash) const {
+			return (uint64_t)(vec_hash >> 64) % NUM_SHARDS;
+		}
+
+		std::vector<shard> shards;
+		std::atomic<uint64_t> next_id{1};
+};
+
+/* Color classes of an input that is itself a colored dbg, e.g., an
+ * intermediate index of the hierarchical build. The count of a k-mer in the
+ * input CQF is its eq class id in eqclasses, and the sample ids in eqclasses
+ * are relative to first_sample, with num_bv_buffer classes per element of
+ * eqclasses. An input without eqclasses is a plain Squeakr CQF of the single
+ * sample first_sample. */
+struct InputColorClasses {
+	std::vector<HybridColorClasses> eqclasses;
+	uint64_t num_bv_buffer{mantis::NUM_BV_BUFFER};
+	uint32_t first_sample{0};
+};
+
 template <class qf_obj, class key_obj>
 class ColoredDbg {
 	public:
+		// num_bv_buffer is the number of color classes per color class file.
 		ColoredDbg(std::string& cqf_file, std::vector<std::string>& eqclass_files,
-							 std::string& sample_file, int flag);
+							 std::string& sample_file, int flag, uint64_t num_bv_buffer);
 
 		ColoredDbg(uint64_t qbits, uint64_t key_bits, enum qf_hashmode hashmode,
-							 uint32_t seed, std::string& prefix, uint64_t nqf, int flag);
+							 uint32_t seed, std::string& prefix, uint64_t nqf, int flag,
+							 uint64_t num_bv_buffer);
+		~ColoredDbg() { wait_for_bv_writer(); }
 
 		void build_sampleid_map(qf_obj *incqfs);
 
@@ -65,6 +164,21 @@ class ColoredDbg {
 			construct(qf_obj *incqfs, uint64_t num_kmers);
 
 		void set_console(spdlog::logger* c) { console = c; }
+		void set_num_threads(uint32_t n) {
+			num_threads = n > 0 ? n : 1;
+			dbg.set_resize_threads(num_threads);
+		}
+		// Drop the resident pages of the mmapped CQFs when the RSS goes over
+		// mem_limit bytes during construct. 0 means no limit.
+		void set_mem_limit(uint64_t bytes) { mem_limit = bytes; }
+		// The inputs passed to construct are colored dbgs with these color
+		// classes instead of one CQF per sample. input_colors must outlive the
+		// calls to construct.
+		void set_input_colors(const std::vector<InputColorClasses>*
+													input_colors) {
+			this->input_colors = input_colors;
+			num_inputs = input_colors->size();
+		}
 		const CQF<key_obj> *get_cqf(void) const { return &dbg; }
 		uint64_t get_num_bitvectors(void) const;
 		uint64_t get_num_eqclasses(void) const { return eqclass_map.size(); }
@@ -79,20 +193,60 @@ class ColoredDbg {
         std::unordered_map<uint64_t, std::vector<uint64_t>>
             find_samples(const std::unordered_map<mantis::KmerHash, uint64_t> &uniqueKmers);
 
+		// Fraction of the hash space merged so far. The k-mers merged by
+		// construct are the ones with a hash below next_hash.
+		double merged_fraction(void) const {
+			return (double)next_hash / (double)dbg.range();
+		}
+
 		void serialize();
-		void reinit(default_cdbg_bv_map_t& map);
+		// Start over with a dbg of at least 2^qbits slots and the eq class ids
+		// in map.
+		void reinit(default_cdbg_bv_map_t& map, uint64_t qbits);
+		// Renumber the eq classes found so far using map and keep the k-mers
+		// merged so far in a dbg of at least 2^qbits slots. The next call to
+		// construct resumes the merge.
+		void remap(default_cdbg_bv_map_t& map, uint64_t qbits);
 		void set_flush_eqclass_dist(void) { flush_eqclass_dis = true; }
 
 	private:
+		// The color class of a k-mer is passed around as the sorted list of
+		// the samples it is present in, so the cost per k-mer is proportional
+		// to the number of samples it is present in and not to num_samples.
+		//
 		// returns true if adding this k-mer increased the number of equivalence
 		// classes
 		// and false otherwise.
-		bool add_kmer(const typename key_obj::kmer_t& hash, const BitVector&
-									vector);
-		void add_bitvector(const BitVector& vector, uint64_t eq_id);
-		void add_eq_class(BitVector vector, uint64_t id);
+		bool add_kmer(const typename key_obj::kmer_t& hash, const
+									std::vector<uint32_t>& sample_ids);
+		static __uint128_t eq_class_hash(const std::vector<uint32_t>&
+																		 sample_ids) {
+			return MurmurHash128A((void*)sample_ids.data(),
+														sample_ids.size() * sizeof(uint32_t),
+														2038074743, 2038074751);
+		}
+		void add_bitvector(const std::vector<uint32_t>& sample_ids, uint64_t
+											 eq_id);
+		void add_bitvector_concurrent(const std::vector<uint32_t>& sample_ids,
+																	uint64_t eq_id);
+		// returns true if the vector is a new equivalence class. The id of the
+		// equivalence class is returned in eq_id.
+		bool add_eq_class(const std::vector<uint32_t>& sample_ids, uint64_t&
+											eq_id);
+		void insert_kmer(const typename key_obj::kmer_t& key, uint64_t eq_id);
+		void insert_kmer_concurrent(const typename key_obj::kmer_t& key, uint64_t
+																eq_id);
 		uint64_t get_next_available_id(void);
-		void bv_buffer_serialize();
+		void bv_buffer_serialize(uint64_t num_eqclasses);
+		void write_eqclasses(const BitVector& rows, const std::string& bv_file);
+		// Logs how much memory the build uses. Over mem_limit, it waits for the
+		// color class buffer being written and drops pages.
+		void check_memory(qf_obj *incqfs);
+		void wait_for_bv_writer(void) {
+			std::lock_guard<std::mutex> guard(bv_writer_lock);
+			if (bv_writer.joinable())
+				bv_writer.join();
+		}
 		void reshuffle_bit_vectors(cdbg_bv_map_t<__uint128_t, std::pair<uint64_t,
 															 uint64_t>>& map);
 
@@ -100,13 +254,38 @@ class ColoredDbg {
 		// bit_vector --> <eq_class_id, abundance>
 		cdbg_bv_map_t<__uint128_t, std::pair<uint64_t, uint64_t>> eqclass_map;
 		CQF<key_obj> dbg;
+		// Color classes per bv_buffer and per color class file.
+		uint64_t num_bv_buffer;
 		BitVector bv_buffer;
-		std::vector<BitVectorRRR> eqclasses;
+		// Compresses and writes the last full bv_buffer.
+		std::thread bv_writer;
+		// Held while bv_writer is joined or started. check_memory can wait for
+		// it from one merge thread while another serializes a buffer.
+		std::mutex bv_writer_lock;
+		// Size of the buffer bv_writer is writing. 0 once it is written.
+		std::atomic<uint64_t> bv_writer_bytes{0};
+		uint64_t mem_limit{0};
+		std::vector<HybridColorClasses> eqclasses;
 		std::string prefix;
 		uint64_t num_samples;
-		uint64_t num_serializations;
+		uint64_t num_inputs;
+		const std::vector<InputColorClasses>* input_colors{nullptr};
+		std::atomic<uint64_t> num_serializations;
+		// Hash of the first k-mer that is not merged yet.
+		__uint128_t next_hash{0};
+		// insert_kmer appends to the dbg, so every k-mer it gets must have a
+		// hash of at least this.
+		__uint128_t min_append_hash{0};
 		int dbg_alloc_flag;
 		bool flush_eqclass_dis{false};
+		uint32_t num_threads{1};
+		// eq classes and the number of bit vectors in bv_buffer during the
+		// multi-threaded merge.
+		sharded_cdbg_bv_map eqclass_table;
+		std::atomic<uint64_t> num_bv_rows{0};
+		// inserts into the dbg hold it shared, resizing the dbg holds it
+		// exclusive.
+		std::shared_mutex dbg_resize_lock;
 		std::time_t start_time_;
 		spdlog::logger* console;
 };
@@ -153,22 +332,22 @@ uint64_t ColoredDbg<qf_obj, key_obj>::get_num_bitvectors(void) const {
 	for (uint32_t i = 0; i < num_serializations; i++)
 		total += eqclasses[i].size();
 
-	return total / num_samples;
+	return total;
 }
 
 template <class qf_obj, class key_obj>
 void ColoredDbg<qf_obj,
 		 key_obj>::reshuffle_bit_vectors(cdbg_bv_map_t<__uint128_t,
 																		 std::pair<uint64_t, uint64_t>>& map) {
-			 BitVector new_bv_buffer(mantis::NUM_BV_BUFFER * num_samples);
+			 BitVector new_bv_buffer(num_bv_buffer * num_samples);
 			 for (auto& it_input : map) {
 				 auto it_local = eqclass_map.find(it_input.first);
 				 if (it_local == eqclass_map.end()) {
 					 console->error("Can't find the vector hash during shuffling");
 					 exit(1);
 				 } else {
-					 assert(it_local->second.first <= mantis::NUM_BV_BUFFER &&
-									it_input.second.first <= mantis::NUM_BV_BUFFER);
+					 assert(it_local->second.first <= num_bv_buffer &&
+									it_input.second.first <= num_bv_buffer);
 					 uint64_t src_idx = ((it_local->second.first - 1) * num_samples);
 					 uint64_t dest_idx = ((it_input.second.first - 1) * num_samples);
 					 for (uint32_t i = 0; i < num_samples; i++, src_idx++, dest_idx++)
@@ -181,40 +360,101 @@ void ColoredDbg<qf_obj,
 
 template <class qf_obj, class key_obj>
 void ColoredDbg<qf_obj, key_obj>::reinit(cdbg_bv_map_t<__uint128_t,
-																				 std::pair<uint64_t, uint64_t>>& map) {
+																				 std::pair<uint64_t, uint64_t>>& map,
+																				 uint64_t qbits) {
 	// dbg.reset();
-	uint64_t qbits = log2(dbg.numslots());
+	qbits = std::max(qbits, (uint64_t)log2(dbg.numslots()));
 	uint64_t keybits = dbg.keybits();
 	enum qf_hashmode hashmode = dbg.hash_mode();
 	uint64_t seed = dbg.seed();
 	dbg.delete_file();
 	CQF<key_obj>cqf(qbits, keybits, hashmode, seed, prefix + mantis::CQF_FILE);
 	dbg = cqf;
+	// A new CQF does not resize itself. The dbg built before reinit did.
+	dbg.set_auto_resize();
+	dbg.set_resize_threads(num_threads);
+
+	next_hash = 0;
+	min_append_hash = 0;
 
 	reshuffle_bit_vectors(map);
 	// Check if the current bit vector buffer is full and needs to be serialized.
 	// This happens when the sampling phase fills up the bv buffer.
-	if (get_num_eqclasses() % mantis::NUM_BV_BUFFER == 0) {
+	if (get_num_eqclasses() % num_bv_buffer == 0) {
 		// The bit vector buffer is full.
 		console->info("Serializing bit vector with {} eq classes.",
 									get_num_eqclasses());
-		bv_buffer_serialize();
+		bv_buffer_serialize(num_bv_buffer);
 	}
 	eqclass_map = map;
 }
 
 template <class qf_obj, class key_obj>
-bool ColoredDbg<qf_obj, key_obj>::add_kmer(const typename key_obj::kmer_t&
-																					 key, const BitVector& vector) {
-	// A kmer (hash) is seen only once during the merge process.
-	// So we insert every kmer in the dbg
-	uint64_t eq_id;
-	__uint128_t vec_hash = MurmurHash128A((void*)vector.data(),
-																				vector.capacity()/8, 2038074743,
-																				2038074751);
+void ColoredDbg<qf_obj, key_obj>::remap(cdbg_bv_map_t<__uint128_t,
+																				std::pair<uint64_t, uint64_t>>& map,
+																				uint64_t qbits) {
+	std::vector<uint64_t> new_ids(get_num_eqclasses() + 1, 0);
+	for (auto& it : eqclass_map) {
+		auto it_new = map.find(it.first);
+		if (it_new == map.end()) {
+			console->error("Can't find the vector hash during remapping");
+			exit(1);
+		}
+		new_ids[it.second.first] = it_new->second.first;
+	}
+
+	// Grow the dbg to the predicted size before the ids change, as a new id
+	// can take more slots than the old one.
+	if (qbits > (uint64_t)log2(dbg.numslots())) {
+		console->info("Resizing the CQF to {} slots.", 1ULL << qbits);
+		if (dbg.resize(1ULL << qbits) <= 0) {
+			console->error("Resizing the CQF during remapping failed.");
+			exit(1);
+		}
+	}
+
+	// The eq class id of a k-mer is its count in the dbg, so the counts are
+	// changed in place in hash order. Changing a count moves the k-mers after
+	// it, so the walk restarts after each k-mer whose id changed. The dbg keeps
+	// its file, and the merge appends after the last sampled k-mer as before.
+	__uint128_t range = dbg.range();
+	uint64_t num_changed = 0;
+	auto it = dbg.begin();
+	while (!it.done()) {
+		key_obj cur = it.get_cur_hash();
+		uint64_t new_id = new_ids[cur.count];
+		if (new_id == cur.count) {
+			++it;
+			continue;
+		}
+		cur.count = new_id;
+		if (dbg.set_count(cur, QF_NO_LOCK | QF_KEY_IS_HASH) < 0) {
+			console->error("Can't change the eq class id of k-mer {} during remapping.",
+										 cur.key);
+			exit(1);
+		}
+		num_changed++;
+		if ((__uint128_t)cur.key + 1 >= range)
+			break;
+		it = dbg.setIteratorLimits(cur.key + 1, range);
+	}
+	console->info("Remapped the eq class ids of {} k-mers.", num_changed);
+
+	reshuffle_bit_vectors(map);
+	if (get_num_eqclasses() % num_bv_buffer == 0) {
+		console->info("Serializing bit vector with {} eq classes.",
+									get_num_eqclasses());
+		bv_buffer_serialize(num_bv_buffer);
+	}
+	eqclass_map = map;
+}
+
+template <class qf_obj, class key_obj>
+bool ColoredDbg<qf_obj, key_obj>::add_eq_class(const std::vector<uint32_t>&
+																							 sample_ids, uint64_t& eq_id) {
+	__uint128_t vec_hash = eq_class_hash(sample_ids);
 
 	auto it = eqclass_map.find(vec_hash);
-	bool added_eq_class{false};
 	// Find if the eqclass of the kmer is already there.
 	// If it is there then increment the abundance.
 	// Else create a new eq class.
@@ -224,61 +464,209 @@ bool ColoredDbg<qf_obj, key_obj>::add_kmer(const typename key_obj::kmer_t&
 		eqclass_map.emplace(std::piecewise_construct,
 												std::forward_as_tuple(vec_hash),
 												std::forward_as_tuple(eq_id, 1));
-		add_bitvector(vector, eq_id - 1);
-		added_eq_class = true;
+		add_bitvector(sample_ids, eq_id - 1);
+		return true;
 	} else { // eq class is seen before so increment the abundance.
 		eq_id = it->second.first;
 		// with standard map
 		it->second.second += 1; // update the abundance.
+		return false;
 	}
+}
 
-	// check: the k-mer should not already be present.
-	uint64_t count = dbg.query(KeyObject(key,0,eq_id), QF_NO_LOCK |
-													   QF_KEY_IS_HASH);
-	if (count > 0) {
-		console->error("K-mer was already present. kmer: {} eqid: {}", key, count);
+template <class qf_obj, class key_obj>
+void ColoredDbg<qf_obj, key_obj>::insert_kmer(const typename key_obj::kmer_t&
+																							key, uint64_t eq_id) {
+	// The k-mers come in increasing hash order, so each one goes after the
+	// last k-mer in the dbg. A k-mer that is already present or out of order
+	// would corrupt the CQF.
+	if ((__uint128_t)key < min_append_hash) {
+		console->error("K-mer is out of order or already present. kmer: {} eqid: {}",
+									 key, eq_id);
 		exit(1);
 	}
+	min_append_hash = (__uint128_t)key + 1;
 
 	// we use the count to store the eqclass ids
-	int ret = dbg.insert(KeyObject(key,0,eq_id), QF_NO_LOCK | QF_KEY_IS_HASH);
+	int ret = dbg.append(KeyObject(key,0,eq_id), QF_NO_LOCK | QF_KEY_IS_HASH);
 	if (ret == QF_NO_SPACE) {
 		// This means that auto_resize failed. 
 		console->error("The CQF is full and auto resize failed. Please rerun build with a bigger size.");
 		exit(1);
 	}
+}
+
+template <class qf_obj, class key_obj>
+void ColoredDbg<qf_obj, key_obj>::insert_kmer_concurrent(const typename
+																												 key_obj::kmer_t& key,
+																												 uint64_t eq_id) {
+	KeyObject kmer(key, 0, eq_id);
+	uint64_t nslots;
+	{
+		// Partitions are disjoint hash ranges so the k-mer can not be present.
+		// Resize well before the CQF's own 95% cutoff as every thread can add a
+		// slot between the check and its insert.
+		std::shared_lock<std::shared_mutex> guard(dbg_resize_lock);
+		nslots = dbg.numslots();
+		if (dbg.occupied_slots() < nslots * 0.9 &&
+				dbg.insert(kmer, QF_WAIT_FOR_LOCK | QF_KEY_IS_HASH) != QF_NO_SPACE)
+			return;
+	}
+
+	// The CQF is filling up. Resize it while no other thread is inserting.
+	// Auto resize is safe here and lets the CQF grow again if the k-mers
+	// re-inserted during the resize do not fit.
+	std::unique_lock<std::shared_mutex> guard(dbg_resize_lock);
+	dbg.set_auto_resize(true);
+	if (dbg.numslots() == nslots) {
+		console->info("Resizing the CQF to {} slots.", nslots * 2);
+		if (dbg.resize(nslots * 2) <= 0) {
+			console->error("The CQF is full and resize failed. Please rerun build with a bigger size.");
+			exit(1);
+		}
+	}
+	// The insert may have gone through even if the CQF reported no space.
+	if (dbg.query(kmer, QF_NO_LOCK | QF_KEY_IS_HASH) == 0 &&
+			dbg.insert(kmer, QF_NO_LOCK | QF_KEY_IS_HASH) == QF_NO_SPACE) {
+		console->error("The CQF is full and auto resize failed. Please rerun build with a bigger size.");
+		exit(1);
+	}
+	dbg.set_auto_resize(false);
+}
+
+template <class qf_obj, class key_obj>
+bool ColoredDbg<qf_obj, key_obj>::add_kmer(const typename key_obj::kmer_t&
+																					 key, const std::vector<uint32_t>&
+																					 sample_ids) {
+	// A kmer (hash) is seen only once during the merge process.
+	// So we insert every kmer in the dbg
+	uint64_t eq_id;
+	bool added_eq_class = add_eq_class(sample_ids, eq_id);
+	insert_kmer(key, eq_id);
 
 	return added_eq_class;
 }
 
 template <class qf_obj, class key_obj>
-void ColoredDbg<qf_obj, key_obj>::add_bitvector(const BitVector& vector,
-																								uint64_t eq_id) {
-	uint64_t start_idx = (eq_id  % mantis::NUM_BV_BUFFER) * num_samples;
-	for (uint32_t i = 0; i < num_samples/64*64; i+=64)
-		bv_buffer.set_int(start_idx+i, vector.get_int(i, 64), 64);
-	if (num_samples%64)
-		bv_buffer.set_int(start_idx+num_samples/64*64,
-											vector.get_int(num_samples/64*64, num_samples%64),
-											num_samples%64);
+void ColoredDbg<qf_obj, key_obj>::add_bitvector(const std::vector<uint32_t>&
+																								sample_ids, uint64_t eq_id) {
+	// The row of a new eq class in the buffer is all zeros.
+	uint64_t *data = bv_buffer.data();
+	uint64_t start_idx = (eq_id  % num_bv_buffer) * num_samples;
+	for (auto id : sample_ids) {
+		uint64_t pos = start_idx + id;
+		data[pos / 64] |= 1ULL << (pos % 64);
+	}
 }
 
 template <class qf_obj, class key_obj>
-void ColoredDbg<qf_obj, key_obj>::bv_buffer_serialize() {
-	BitVector bv_temp(bv_buffer);
-	if (get_num_eqclasses() % mantis::NUM_BV_BUFFER > 0) {
-		bv_temp.resize((get_num_eqclasses() % mantis::NUM_BV_BUFFER) *
-									 num_samples);
+void ColoredDbg<qf_obj, key_obj>::add_bitvector_concurrent(const
+																													 std::vector<uint32_t>&
+																													 sample_ids, uint64_t
+																													 eq_id) {
+	// Wait till the buffer that holds this eq class is the current one.
+	uint64_t buffer_id = eq_id / num_bv_buffer;
+	while (num_serializations < buffer_id)
+		std::this_thread::yield();
+
+	// Bit vectors of two eq classes can share a word in the buffer. So the bits
+	// are or'ed in atomically. The buffer is all zeros to begin with.
+	// The sample ids are sorted, so the bits that go in the same word are
+	// next to each other and each word is updated once.
+	uint64_t *data = bv_buffer.data();
+	uint64_t start_idx = (eq_id % num_bv_buffer) * num_samples;
+	for (uint64_t i = 0; i < sample_ids.size(); ) {
+		uint64_t word = (start_idx + sample_ids[i]) / 64, wrd = 0;
+		for (; i < sample_ids.size() &&
+				 (start_idx + sample_ids[i]) / 64 == word; i++)
+			wrd |= 1ULL << ((start_idx + sample_ids[i]) % 64);
+		__atomic_fetch_or(&data[word], wrd, __ATOMIC_RELAXED);
 	}
 
-	BitVectorRRR final_com_bv(bv_temp);
-	std::string bv_file(prefix + std::to_string(num_serializations) + "_" +
+	// The thread that adds the last bit vector serializes the buffer.
+	if (++num_bv_rows == num_bv_buffer) {
+		num_bv_rows = 0;
+		console->info("Serializing bit vector with {} eq classes.",
+									(buffer_id + 1) * num_bv_buffer);
+		bv_buffer_serialize(num_bv_buffer);
+	}
+}
+
+template <class qf_obj, class key_obj>
+void ColoredDbg<qf_obj, key_obj>::bv_buffer_serialize(uint64_t num_eqclasses) {
+	// Only one buffer is written at a time, so the build never holds more
+	// than two.
+	std::lock_guard<std::mutex> guard(bv_writer_lock);
+	if (bv_writer.joinable())
+		bv_writer.join();
+	std::string bv_file(prefix + std::to_string(num_serializations.load()) + "_" +
 											mantis::EQCLASS_FILE);
-	sdsl::store_to_file(final_com_bv, bv_file);
-	bv_buffer = BitVector(bv_buffer.bit_size());
+	if (num_eqclasses < num_bv_buffer) {
+		// The last buffer. Nothing is merged after it.
+		bv_buffer.resize(num_eqclasses * num_samples);
+		write_eqclasses(bv_buffer, bv_file);
+		bv_buffer = BitVector(num_bv_buffer * num_samples);
+	} else {
+		// The full buffer is compressed on bv_writer while the merge goes on
+		// with a new one.
+		bv_writer_bytes = bv_buffer.capacity() / 8;
+		bv_writer = std::thread([this, bv_file, rows = std::move(bv_buffer)]() {
+														write_eqclasses(rows, bv_file);
+														bv_writer_bytes = 0; });
+		bv_buffer = BitVector(num_bv_buffer * num_samples);
+	}
 	num_serializations++;
 }
 
+template <class qf_obj, class key_obj>
+void ColoredDbg<qf_obj, key_obj>::write_eqclasses(const BitVector& rows,
+																									const std::string& bv_file) {
+	HybridColorClasses final_com_bv(rows, num_samples);
+	console->info("Color classes: {} dense, {} delta coded, {} run-length coded.",
+								final_com_bv.count(HybridColorClasses::DENSE),
+								final_com_bv.count(HybridColorClasses::DELTA),
+								final_com_bv.count(HybridColorClasses::RUN_LENGTH));
+	if (!sdsl::store_to_file(final_com_bv, bv_file)) {
+		console->error("Could not write color classes to {}", bv_file);
+		exit(1);
+	}
+}
+
+template <class qf_obj, class key_obj>
+void ColoredDbg<qf_obj, key_obj>::check_memory(qf_obj *incqfs) {
+	const uint64_t MB = 1ULL << 20;
+	uint64_t rss = get_resident_bytes();
+	uint64_t cqf_bytes = dbg.size_in_bytes();
+	uint64_t bv_bytes = num_bv_buffer * num_samples / 8 + bv_writer_bytes;
+	// The multi-threaded merge keeps the eq classes in eqclass_table and
+	// eqclass_map is empty. Otherwise eqclass_table is empty.
+	uint64_t map_bytes = cdbg_bv_map_bytes(eqclass_map) +
+		eqclass_table.size_in_bytes();
+	uint64_t counted = cqf_bytes + bv_bytes + map_bytes;
+	console->info("Memory: RSS {} MB, output CQF {} MB, color class buffers {} MB, eq class table {} MB, mmapped inputs and other {} MB",
+								rss / MB, cqf_bytes / MB, bv_bytes / MB, map_bytes / MB,
+								rss > counted ? (rss - counted) / MB : 0);
+	if (mem_limit == 0 || rss <= mem_limit)
+		return;
+
+	// Every color class file holds num_bv_buffer classes, so a partial buffer
+	// can not be written early. But the full buffer that is being compressed
+	// and its compressed form are freed once bv_writer is done.
+	// The CQFs are read and written in hash order, so most of their resident
+	// pages are not needed again soon. The eq class table can not be given
+	// back until the merge is done.
+	console->warn("RSS of {} MB is over the limit of {} MB. Waiting for the color class writer and dropping the pages of the mmapped CQFs.",
+								rss / MB, mem_limit / MB);
+	wait_for_bv_writer();
+	{
+		std::shared_lock<std::shared_mutex> guard(dbg_resize_lock);
+		dbg.drop_resident_pages();
+	}
+	for (uint32_t i = 0; i < num_inputs; i++)
+		incqfs[i].obj->drop_resident_pages();
+	console->info("RSS after dropping pages: {} MB", get_resident_bytes() / MB);
+}
+
 template <class qf_obj, class key_obj>
 void ColoredDbg<qf_obj, key_obj>::serialize() {
 	// serialize the CQF
@@ -288,8 +676,9 @@ void ColoredDbg<qf_obj, key_obj>::serialize() {
 		dbg.close();
 
 	// serialize the bv buffer last time if needed
-	if (get_num_eqclasses() % mantis::NUM_BV_BUFFER > 0)
-		bv_buffer_serialize();
+	if (get_num_eqclasses() % num_bv_buffer > 0)
+		bv_buffer_serialize(get_num_eqclasses() % num_bv_buffer);
+	wait_for_bv_writer();
 
 	//serialize the eq class id map
 	std::ofstream opfile(prefix + mantis::SAMPLEID_FILE);
@@ -313,12 +702,12 @@ ColoredDbg<qf_obj,key_obj>::find_samples(const mantis::QuerySet& kmers) {
 	// Find a list of eq classes and the number of kmers that belong those eq
 	// classes.
 	std::unordered_map<uint64_t, uint64_t> query_eqclass_map;
-	for (auto k : kmers) {
-		key_obj key(k, 0, 0);
-		uint64_t eqclass = dbg.query(key, 0);
+	std::vector<uint64_t> keys(kmers.begin(), kmers.end());
+	std::vector<uint64_t> counts(keys.size());
+	dbg.query_batch(keys.data(), keys.size(), counts.data(), 0);
+	for (auto eqclass : counts)
 		if (eqclass)
 			query_eqclass_map[eqclass] += 1;
-	}
 
 	std::vector<uint64_t> sample_map(num_samples, 0);
 	for (auto it = query_eqclass_map.begin(); it != query_eqclass_map.end();
@@ -327,16 +716,10 @@ ColoredDbg<qf_obj,key_obj>::find_samples(const mantis::QuerySet& kmers) {
 		auto count = it->second;
 		// counter starts from 1.
 		uint64_t start_idx = (eqclass_id - 1);
-		uint64_t bucket_idx = start_idx / mantis::NUM_BV_BUFFER;
-		uint64_t bucket_offset = (start_idx % mantis::NUM_BV_BUFFER) * num_samples;
-		for (uint32_t w = 0; w <= num_samples / 64; w++) {
-			uint64_t len = std::min((uint64_t)64, num_samples - w * 64);
-			uint64_t wrd = eqclasses[bucket_idx].get_int(bucket_offset, len);
-			for (uint32_t i = 0, sCntr = w * 64; i < len; i++, sCntr++)
-				if ((wrd >> i) & 0x01)
-					sample_map[sCntr] += count;
-			bucket_offset += len;
-		}
+		uint64_t bucket_idx = start_idx / num_bv_buffer;
+		eqclasses[bucket_idx].for_each_sample(start_idx % num_bv_buffer,
+																					[&](uint64_t id) {
+																						sample_map[id] += count; });
 	}
 	return sample_map;
 }
@@ -347,14 +730,14 @@ ColoredDbg<qf_obj,key_obj>::find_samples(const std::unordered_map<mantis::KmerHa
 	// Find a list of eq classes and the number of kmers that belong those eq
 	// classes.
 	std::unordered_map<uint64_t, std::vector<uint64_t>> query_eqclass_map;
-	for (auto kv : uniqueKmers) {
-		key_obj key(kv.first, 0, 0);
-		uint64_t eqclass = dbg.query(key, 0);
-		if (eqclass) {
-		    kv.second = eqclass;
-            query_eqclass_map[eqclass] = std::vector<uint64_t>();
-        }
-	}
+	std::vector<uint64_t> keys, counts(uniqueKmers.size());
+	keys.reserve(uniqueKmers.size());
+	for (auto &kv : uniqueKmers)
+		keys.push_back(kv.first);
+	dbg.query_batch(keys.data(), keys.size(), counts.data(), 0);
+	for (auto eqclass : counts)
+		if (eqclass)
+			query_eqclass_map[eqclass] = std::vector<uint64_t>();
 
 	std::vector<uint64_t> sample_map(num_samples, 0);
 	for (auto it = query_eqclass_map.begin(); it != query_eqclass_map.end();
@@ -363,16 +746,10 @@ ColoredDbg<qf_obj,key_obj>::find_samples(const std::unordered_map<mantis::KmerHa
 		auto &vec = it->second;
 		// counter starts from 1.
 		uint64_t start_idx = (eqclass_id - 1);
-		uint64_t bucket_idx = start_idx / mantis::NUM_BV_BUFFER;
-		uint64_t bucket_offset = (start_idx % mantis::NUM_BV_BUFFER) * num_samples;
-		for (uint32_t w = 0; w <= num_samples / 64; w++) {
-			uint64_t len = std::min((uint64_t)64, num_samples - w * 64);
-			uint64_t wrd = eqclasses[bucket_idx].get_int(bucket_offset, len);
-			for (uint32_t i = 0, sCntr = w * 64; i < len; i++, sCntr++)
-				if ((wrd >> i) & 0x01)
-					vec.push_back(sCntr);
-			bucket_offset += len;
-		}
+		uint64_t bucket_idx = start_idx / num_bv_buffer;
+		eqclasses[bucket_idx].for_each_sample(start_idx % num_bv_buffer,
+																					[&vec](uint64_t id) {
+																						vec.push_back(id); });
 	}
 	return query_eqclass_map;
 }
@@ -381,19 +758,30 @@ template <class qf_obj, class key_obj>
 cdbg_bv_map_t<__uint128_t, std::pair<uint64_t, uint64_t>>& ColoredDbg<qf_obj,
 	key_obj>::construct(qf_obj *incqfs, uint64_t num_kmers)
 {
-	uint64_t counter = 0;
 	bool is_sampling = (num_kmers < std::numeric_limits<uint64_t>::max());
+	// The sampling phase looks at the first num_kmers k-mers in hash order. So
+	// it always runs on a single partition.
+	uint32_t num_parts = is_sampling ? 1 : num_threads;
 
 	struct Iterator {
 		QFi qfi;
-		typename key_obj::kmer_t kmer;
+		typename key_obj::kmer_t kmer{0};
+		uint64_t count{0};
+		__uint128_t end_hash;
 		uint32_t id;
 		bool do_madvice{false};
-		Iterator(uint32_t id, const QF* cqf, bool flag): id(id), do_madvice(flag)
+		Iterator(uint32_t id, const QF* cqf, __uint128_t start_hash, __uint128_t
+						 end_hash, bool flag): end_hash(end_hash), id(id), do_madvice(flag)
 		{
-			if (qf_iterator_from_position(cqf, &qfi, 0) != QFI_INVALID) {
+			if (start_hash == 0)
+				qf_iterator_from_position(cqf, &qfi, 0);
+			else
+				qf_iterator_from_key_value(cqf, &qfi, start_hash, 0, QF_KEY_IS_HASH);
+			if (!qfi_end(&qfi)) {
 				get_key();
-        if (do_madvice)
+				// Only the first partition can drop the pages before its start.
+				// Other partitions are still reading them.
+        if (do_madvice && start_hash == 0)
           qfi_initial_madvise(&qfi);
       }
 		}
@@ -404,100 +792,155 @@ cdbg_bv_map_t<__uint128_t, std::pair<uint64_t, uint64_t>>& ColoredDbg<qf_obj,
 				if (qfi_next(&qfi) == QFI_INVALID) return false;
 			}
 			get_key();
-			return true;
+			return kmer < end_hash;
 		}
 		bool end() const {
-			return qfi_end(&qfi);
-		}
-		bool operator>(const Iterator& rhs) const {
-			return key() > rhs.key();
+			return qfi_end(&qfi) || kmer >= end_hash;
 		}
 		const typename key_obj::kmer_t& key() const { return kmer; }
 		private:
 		void get_key() {
-			uint64_t value, count;
+			uint64_t value;
 			qfi_get_hash(&qfi, &kmer, &value, &count);
 		}
 	};
 
-  typename CQF<key_obj>::Iterator walk_behind_iterator;
-  
-	struct Minheap_PQ {
-		void push(const Iterator& obj) {
-			c.emplace_back(obj);
-			std::push_heap(c.begin(), c.end(), std::greater<Iterator>());
-		}
-		void pop() {
-			std::pop_heap(c.begin(), c.end(), std::greater<Iterator>());
-			c.pop_back();
-		}
-		void replace_top(const Iterator& obj) {
-			c.emplace_back(obj);
-			pop();
-		}
-		Iterator& top() { return c.front(); }
-		bool empty() const { return c.empty(); }
-		private:
-		std::vector<Iterator> c;
-	};
-	Minheap_PQ minheap;
+	std::atomic<uint64_t> num_merged{0};
+	// The dbg can be resized by another partition, so read the range up front.
+	__uint128_t range = dbg.range();
+	// The merge picks up after the k-mers merged by an earlier call, if any.
+	__uint128_t first_hash = next_hash;
+	__uint128_t part_size = (range - first_hash) / num_parts;
+	next_hash = range;
 
-	for (uint32_t i = 0; i < num_samples; i++) {
-		Iterator qfi(i, incqfs[i].obj->get_cqf(), true);
-		if (qfi.end()) continue;
-		minheap.push(qfi);
-	}
+	// Merge the k-mers in the hash range of partition "part" from all the input
+	// CQFs. Partitions are disjoint ranges of the hash space so they can be
+	// merged independently and write into the same output CQF.
+	auto merge_partition = [&](uint32_t part) {
+		__uint128_t start_hash = first_hash + part * part_size;
+		__uint128_t end_hash = part + 1 == num_parts ? range :
+			first_hash + (part + 1) * part_size;
 
-	while (!minheap.empty()) {
-		BitVector eq_class(num_samples);
-		KeyObject::kmer_t last_key;
-		do {
-			Iterator& cur = minheap.top();
-			last_key = cur.key();
-			eq_class[cur.id] = 1;
-			if (cur.next())
-				minheap.replace_top(cur);
-			else
-				minheap.pop();
-		} while(!minheap.empty() && last_key == minheap.top().key());
-		bool added_eq_class = add_kmer(last_key, eq_class);
-		++counter;
-
-    if (counter == 4096) {
-      walk_behind_iterator = dbg.begin(true);
-    } else if (counter > 4096) {
-      ++walk_behind_iterator;
-    }
-    
-		// Progress tracker
-		static uint64_t last_size = 0;
-		if (dbg.dist_elts() % 10000000 == 0 &&
-				dbg.dist_elts() != last_size) {
-			last_size = dbg.dist_elts();
-			console->info("Kmers merged: {}  Num eq classes: {}  Total time: {}",
-										dbg.dist_elts(), get_num_eqclasses(), time(nullptr) -
-										start_time_);
+		// The iterators stay in place and the loser tree only tracks their
+		// current keys.
+		std::vector<Iterator> iters;
+		std::vector<typename key_obj::kmer_t> keys;
+		for (uint32_t i = 0; i < num_inputs; i++) {
+			Iterator qfi(i, incqfs[i].obj->get_cqf(), start_hash, end_hash, true);
+			if (qfi.end()) continue;
+			iters.push_back(qfi);
+			keys.push_back(qfi.key());
 		}
+		LoserTree<typename key_obj::kmer_t> tree(keys);
 
-		// Check if the bit vector buffer is full and needs to be serialized.
-		if (added_eq_class and (get_num_eqclasses() % mantis::NUM_BV_BUFFER == 0))
-		{
-			// Check if the process is in the sampling phase.
-			if (is_sampling) {
+		uint64_t counter = 0;
+		typename CQF<key_obj>::Iterator walk_behind_iterator;
+
+		// Samples the current k-mer is present in. The loser tree breaks ties by
+		// the iterator index, so the ids come out sorted. Colored inputs cover
+		// consecutive ranges of samples in input order.
+		std::vector<uint32_t> eq_class;
+		eq_class.reserve(num_samples);
+		while (!tree.empty()) {
+			eq_class.clear();
+			KeyObject::kmer_t last_key;
+			do {
+				Iterator& cur = iters[tree.top()];
+				last_key = cur.key();
+				if (!input_colors) {
+					eq_class.push_back(cur.id);
+				} else if ((*input_colors)[cur.id].eqclasses.empty()) {
+					eq_class.push_back((*input_colors)[cur.id].first_sample);
+				} else {
+					const InputColorClasses& in = (*input_colors)[cur.id];
+					uint64_t idx = cur.count - 1;
+					in.eqclasses[idx / in.num_bv_buffer].for_each_sample(
+						idx % in.num_bv_buffer, [&](uint64_t id) {
+							eq_class.push_back(in.first_sample + id); });
+				}
+				if (cur.next())
+					tree.replace_top(cur.key());
+				else
+					tree.pop();
+			} while(!tree.empty() && last_key == tree.top_key());
+			++counter;
+
+			if (num_parts > 1) {
+				uint64_t eq_id;
+				if (eqclass_table.add(eq_class_hash(eq_class), eq_id))
+					add_bitvector_concurrent(eq_class, eq_id - 1);
+				insert_kmer_concurrent(last_key, eq_id);
+
+				// Progress tracker
+				uint64_t merged = ++num_merged;
+				if (merged % 10000000 == 0) {
+					console->info("Kmers merged: {}  Num eq classes: {}  Total time: {}",
+												merged, eqclass_table.size(), time(nullptr) -
+												start_time_);
+					check_memory(incqfs);
+				}
+				continue;
+			}
+
+			bool added_eq_class = add_kmer(last_key, eq_class);
+
+			if (counter == 4096) {
+				walk_behind_iterator = dbg.begin(true);
+			} else if (counter > 4096) {
+				++walk_behind_iterator;
+			}
+
+			// Progress tracker
+			static uint64_t last_size = 0;
+			if (dbg.dist_elts() % 10000000 == 0 &&
+					dbg.dist_elts() != last_size) {
+				last_size = dbg.dist_elts();
+				console->info("Kmers merged: {}  Num eq classes: {}  Total time: {}",
+											dbg.dist_elts(), get_num_eqclasses(), time(nullptr) -
+											start_time_);
+				check_memory(incqfs);
+			}
+
+			// Check if the bit vector buffer is full and needs to be serialized.
+			if (added_eq_class and (get_num_eqclasses() % num_bv_buffer == 0))
+			{
+				// Check if the process is in the sampling phase.
+				if (is_sampling) {
+					next_hash = (__uint128_t)last_key + 1;
+					break;
+				} else {
+					// The bit vector buffer is full.
+					console->info("Serializing bit vector with {} eq classes.",
+												get_num_eqclasses());
+					bv_buffer_serialize(num_bv_buffer);
+				}
+			} else if (counter > num_kmers) {
+				// Check if the sampling phase is finished based on the number of k-mers.
+				next_hash = (__uint128_t)last_key + 1;
 				break;
-			} else {
-				// The bit vector buffer is full.
-				console->info("Serializing bit vector with {} eq classes.",
-											get_num_eqclasses());
-				bv_buffer_serialize();
 			}
-		} else if (counter > num_kmers) {
-			// Check if the sampling phase is finished based on the number of k-mers.
-			break;
+
 		}
+	};
 
-		//while(!minheap.empty() && minheap.top().end()) minheap.pop();
+	if (num_parts == 1) {
+		merge_partition(0);
+	} else {
+		console->info("Merging input CQFs using {} threads.", num_parts);
+		// Auto resize is not thread-safe. Resizing is done by
+		// insert_kmer_concurrent while holding dbg_resize_lock.
+		dbg.set_auto_resize(false);
+		num_bv_rows = get_num_eqclasses() % num_bv_buffer;
+		eqclass_table.load(eqclass_map);
+		std::vector<std::thread> threads;
+		for (uint32_t i = 0; i < num_parts; ++i)
+			threads.emplace_back(merge_partition, i);
+		for (auto& t : threads)
+			t.join();
+		eqclass_table.unload(eqclass_map);
+		dbg.set_auto_resize(true);
 	}
+	check_memory(incqfs);
 	return eqclass_map;
 }
 
@@ -513,9 +956,11 @@ template <class qf_obj, class key_obj>
 ColoredDbg<qf_obj, key_obj>::ColoredDbg(uint64_t qbits, uint64_t key_bits,
 																				enum qf_hashmode hashmode,
 																				uint32_t seed, std::string& prefix,
-																				uint64_t nqf, int flag) :
-	bv_buffer(mantis::NUM_BV_BUFFER * nqf), prefix(prefix), num_samples(nqf),
-	num_serializations(0), start_time_(std::time(nullptr)) {
+																				uint64_t nqf, int flag, uint64_t
+																				num_bv_buffer) :
+	num_bv_buffer(num_bv_buffer), bv_buffer(num_bv_buffer * nqf),
+	prefix(prefix), num_samples(nqf),
+	num_inputs(nqf), num_serializations(0), start_time_(std::time(nullptr)) {
 		if (flag == MANTIS_DBG_IN_MEMORY) {
 			CQF<key_obj> cqf(qbits, key_bits, hashmode, seed);
 			dbg = cqf;
@@ -537,9 +982,11 @@ template <class qf_obj, class key_obj>
 ColoredDbg<qf_obj, key_obj>::ColoredDbg(std::string& cqf_file,
 																				std::vector<std::string>&
 																				eqclass_files, std::string&
-																				sample_file, int flag) : bv_buffer(),
-	start_time_(std::time(nullptr)) {
+																				sample_file, int flag, uint64_t
+																				num_bv_buffer) :
+	num_bv_buffer(num_bv_buffer), bv_buffer(), start_time_(std::time(nullptr)) {
 		num_samples = 0;
+		num_inputs = 0;
 		num_serializations = 0;
 
 		if (flag == MANTIS_DBG_IN_MEMORY) {
@@ -562,10 +1009,9 @@ ColoredDbg<qf_obj, key_obj>::ColoredDbg(std::string& cqf_file,
 		}
 
 		eqclasses.reserve(sorted_files.size());
-		BitVectorRRR bv;
 		for (auto file : sorted_files) {
-			sdsl::load_from_file(bv, file.second);
-			eqclasses.push_back(bv);
+			eqclasses.emplace_back();
+			sdsl::load_from_file(eqclasses.back(), file.second);
 			num_serializations++;
 		}
 
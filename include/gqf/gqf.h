@@ -114,6 +114,45 @@ extern "C" {
 
 	bool qf_free(QF *qf);
 
+	/* The instructions that rank and select on the metadata bits use:
+		 - GENERIC: none beyond x86-64.
+		 - POPCNT: popcnt.
+		 - BMI2: popcnt, and pdep and tzcnt for select.
+		 The best set that the CPU has is picked at startup. BMI2 is not picked
+		 on AMD CPUs before Zen 3, where pdep is slower than the generic select. */
+	enum qf_bitops {
+		QF_BITOPS_GENERIC,
+		QF_BITOPS_POPCNT,
+		QF_BITOPS_BMI2
+	};
+
+	/* Use the instructions of bitops from now on. Returns false, and changes
+		 nothing, if the CPU doesn't have them. Must not be called while another
+		 thread uses a CQF. */
+	bool qf_set_bitops(enum qf_bitops bitops);
+	enum qf_bitops qf_get_bitops(void);
+	const char *qf_bitops_name(enum qf_bitops bitops);
+
+	/* The pages that hold the memory of a CQF. */
+	enum qf_pages {
+		QF_PAGES_NORMAL,
+		QF_PAGES_TRANSPARENT,	/* asked for transparent huge pages */
+		QF_PAGES_HUGETLB_2MB,	/* from the reserved pool of huge pages */
+		QF_PAGES_HUGETLB_1GB
+	};
+
+	/* Back the CQFs that qf_malloc, qf_resize_malloc and qf_deserialize
+		 allocate from now on with huge pages: 1 GB or 2 MB pages from the
+		 reserved pool if it has enough of them, otherwise transparent huge
+		 pages, otherwise normal pages. qf_usefile asks for transparent huge
+		 pages on its mapping, which only file systems that support them in
+		 the page cache honor. Off by default. */
+	void qf_set_huge_pages(bool enabled);
+
+	/* The pages the CQF got. */
+	enum qf_pages qf_get_pages(const QF *qf);
+	const char *qf_pages_name(enum qf_pages pages);
+
 	/* Resize the QF to the specified number of slots.  Uses malloc() to
 	 * obtain the new memory, and calls free() on the old memory.
 	 * Return value:
@@ -126,6 +165,19 @@ extern "C" {
 		 function. */
 	void qf_set_auto_resize(QF* qf, bool enabled);
 
+	/* Copy the items into the new CQF with num_threads threads when qf is
+		 resized. Each thread fills its own range of blocks of the new CQF. */
+	void qf_set_resize_threads(QF* qf, uint32_t num_threads);
+
+	/* Insert all the items of src into dest, which must be empty and have the
+		 same key and value bits as src, using the resize threads of src. Used by
+		 the resize functions.
+		 Return value:
+		    >= 0: number of items copied.
+		    <  0: an insert into dest failed.
+	 */
+	int64_t qf_copy_items(const QF *src, QF *dest);
+
 	/***********************************
    Functions for modifying the CQF.
 	***********************************/
@@ -144,6 +196,15 @@ extern "C" {
 	int qf_insert(QF *qf, uint64_t key, uint64_t value, uint64_t count, uint8_t
 								flags);
 
+	/* Same as qf_insert for a key/value pair that goes after every item in
+	 * the CQF, i.e., whose hash is bigger than all the hashes in the CQF. The
+	 * new counter is written at the end of the last run without shifting
+	 * anything, so a CQF can be filled from sorted input in one forward pass.
+	 * Takes no locks. Inserting a smaller hash corrupts the CQF.
+	 */
+	int qf_append_sorted(QF *qf, uint64_t key, uint64_t value, uint64_t count,
+											 uint8_t flags);
+
 	/* Set the counter for this key/value pair to count. 
 	 Return value: Same as qf_insert. 
 	 Returns 0 if new count is equal to old count.
@@ -200,6 +261,14 @@ extern "C" {
 	uint64_t qf_count_key_value(const QF *qf, uint64_t key, uint64_t value,
 															uint8_t flags);
 
+	/* Sets counts[i] to qf_count_key_value(qf, keys[i], values[i], flags) for
+		 each of the nkeys keys. values can be NULL for value 0. The blocks a
+		 lookup reads are prefetched a few lookups ahead, so that the cache
+		 misses of different lookups overlap. Does not lock the CQF. */
+	void qf_count_key_value_batch(const QF *qf, const uint64_t *keys, const
+																uint64_t *values, uint64_t nkeys, uint64_t
+																*counts, uint8_t flags);
+
 	/* Returns a unique index corresponding to the key in the CQF.  Note
 		 that this can change if further modifications are made to the
 		 CQF.
@@ -48,6 +48,10 @@ extern "C" {
 	/* read data structure off the disk */
 	uint64_t qf_deserialize(QF *qf, const char *filename);
 
+  /* Drop all the resident pages of an mmapped CQF to reduce our RSS.
+     Only valid on mmapped QFs. */
+  int qf_drop_pages(const QF *qf);
+
   /* This wraps qfi_next, using madvise(DONTNEED) to reduce our RSS.
      Only valid on mmapped QFs, i.e. cqfs from qf_initfile and
      qf_usefile. */
@@ -26,6 +26,8 @@ extern "C" {
    0 (choose size at run-time), 
    8, 16, 32, or 64 (for optimized versions),
    or other integer <= 56 (for compile-time-optimized bit-shifting-based versions)
+   With 0, the lookup and iteration code in gqf.c is still compiled for the
+   common widths and picked from the metadata (see DISPATCH_SLOT_WIDTH).
 */
 #define QF_BITS_PER_SLOT 0
 
@@ -77,6 +79,8 @@ extern "C" {
 	typedef struct quotient_filter_runtime_data {
 		file_info f_info;
 		uint32_t auto_resize;
+		/* Threads that copy the items into the new CQF on a resize. 0 means 1. */
+		uint32_t resize_threads;
 		int64_t (*container_resize)(QF *qf, uint64_t nslots);
 		pc_t pc_nelts;
 		pc_t pc_ndistinct_elts;
@@ -85,6 +89,10 @@ extern "C" {
 		volatile int metadata_lock;
 		volatile int *locks;
 		wait_time_data *wait_times;
+		/* The length of the mapping that holds a CQF allocated with huge pages.
+		 * 0 if the memory is from malloc. */
+		uint64_t mapped_size;
+		enum qf_pages pages;
 	} quotient_filter_runtime_data;
 
 	typedef quotient_filter_runtime_data qfruntime;
@@ -149,6 +157,15 @@ extern "C" {
 		cluster_data *c_info;
 	} quotient_filter_iterator;
 
+	/* Allocate size bytes for a CQF with the pages set by qf_set_huge_pages.
+	 * Records in runtime how the memory was allocated so that qf_free can
+	 * release it. */
+	void *qf_alloc_buffer(qfruntime *runtime, uint64_t size);
+
+	/* Ask for transparent huge pages on a mapping that holds a CQF if huge
+	 * pages are enabled. addr must be page aligned. */
+	void qf_advise_huge_pages(qfruntime *runtime, void *addr, uint64_t len);
+
 #ifdef __cplusplus
 }
 #endif
@@ -69,9 +69,21 @@ class CQF {
 		//~CQF();
 
 		int insert(const key_obj& k, uint8_t flags);
+		/* Insert k after every key in the CQF. The keys must come in increasing
+		 * hash order. */
+		int append(const key_obj& k, uint8_t flags);
+		/* Change the count of k in place to k.count. The keys after it can move,
+		 * so iterators over the CQF are invalid afterwards. */
+		int set_count(const key_obj& k, uint8_t flags);
 
 		/* Will return the count. */
 		uint64_t query(const key_obj& k, uint8_t flags);
+		/* Sets counts[i] to the count of keys[i] with value 0. Faster than
+		 * calling query on each key when there are many keys. */
+		void query_batch(const uint64_t *keys, uint64_t nkeys, uint64_t *counts,
+										 uint8_t flags) const {
+			qf_count_key_value_batch(&cqf, keys, NULL, nkeys, counts, flags);
+		}
 
 		uint64_t inner_prod(const CQF<key_obj>& in_cqf);
 
@@ -83,7 +95,18 @@ class CQF {
 		void close() { if (is_filebased) qf_closefile(&cqf); }
 		void delete_file() { if (is_filebased) qf_deletefile(&cqf); }
 
-		void set_auto_resize(void) { qf_set_auto_resize(&cqf, true); }
+		void set_auto_resize(bool enabled = true) {
+			qf_set_auto_resize(&cqf, enabled);
+		}
+		/* Threads that copy the keys when the CQF is resized. */
+		void set_resize_threads(uint32_t num_threads) {
+			qf_set_resize_threads(&cqf, num_threads);
+		}
+		/* Resize the CQF to nslots. Not thread-safe; the caller must make sure
+		 * that no other thread is accessing the CQF. */
+		int64_t resize(uint64_t nslots) {
+			return cqf.runtimedata->container_resize(&cqf, nslots);
+		}
 		int64_t get_unique_index(const key_obj& k, uint8_t flags) const {
 			return qf_get_unique_index(&cqf, k.key, k.value, flags);
 		}
@@ -100,12 +123,23 @@ class CQF {
 		uint64_t total_elts(void) const { return qf_get_sum_of_counts(&cqf); }
 		uint64_t dist_elts(void) const { return
 			qf_get_num_distinct_key_value_pairs(&cqf); }
+		uint64_t occupied_slots(void) const { return
+			qf_get_num_occupied_slots(&cqf); }
+		enum qf_pages pages(void) const { return qf_get_pages(&cqf); }
 		//uint64_t set_size(void) const { return set.size(); }
 		void reset(void) { qf_reset(&cqf); }
 
 		void dump_metadata(void) const { qf_dump_metadata(&cqf); }
 
 		void drop_pages(uint64_t cur);
+		/* Drops the resident pages of a file-backed CQF. */
+		void drop_resident_pages(void) const {
+			if (is_filebased)
+				qf_drop_pages(&cqf);
+		}
+		uint64_t size_in_bytes(void) const {
+			return qf_get_total_size_in_bytes(&cqf);
+		}
 
 		class Iterator {
 			public:
@@ -219,6 +253,16 @@ int CQF<key_obj>::insert(const key_obj& k, uint8_t flags) {
 	//set.insert(k.key);
 }
 
+template <class key_obj>
+int CQF<key_obj>::append(const key_obj& k, uint8_t flags) {
+	return qf_append_sorted(&cqf, k.key, k.value, k.count, flags);
+}
+
+template <class key_obj>
+int CQF<key_obj>::set_count(const key_obj& k, uint8_t flags) {
+	return qf_set_count(&cqf, k.key, k.value, k.count, flags);
+}
+
 template <class key_obj>
 uint64_t CQF<key_obj>::query(const key_obj& k, uint8_t flags) {
 	return qf_count_key_value(&cqf, k.key, k.value, flags);
@@ -0,0 +1,96 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  loser_tree.h
+ *
+ *    Description:  Tournament (loser) tree for merging sorted streams.
+ *
+ * ============================================================================
+ */
+
+#ifndef _LOSER_TREE_H_
+#define _LOSER_TREE_H_
+
+#include <vector>
+#include <utility>
+#include <limits>
+#include <cstdint>
+
+/* Loser tree over k sorted streams. Only the current key of each stream is
+ * kept in the tree, in one contiguous array, so the stream state (e.g., a CQF
+ * iterator) never moves. Internal node i holds the stream that lost the match
+ * at that node and node 0 holds the overall winner. Replacing the winner's key
+ * replays the log2(k) matches on the path from its leaf to the root.
+ *
+ * Ties are broken by the stream index.
+ */
+template <typename Key>
+class LoserTree {
+	public:
+		explicit LoserTree(const std::vector<Key>& init_keys) :
+			keys(init_keys), done(init_keys.size(), 0), tree(init_keys.size()),
+			k(init_keys.size()), num_active(init_keys.size()) {
+				if (k == 0)
+					return;
+				// Play the initial tournament bottom up. Leaf i is at node k + i.
+				std::vector<uint32_t> winner(2 * k);
+				for (uint32_t i = 0; i < k; i++)
+					winner[k + i] = i;
+				for (uint32_t node = k - 1; node > 0; node--) {
+					uint32_t a = winner[2 * node], b = winner[2 * node + 1];
+					if (less(a, b)) {
+						winner[node] = a;
+						tree[node] = b;
+					} else {
+						winner[node] = b;
+						tree[node] = a;
+					}
+				}
+				tree[0] = k > 1 ? winner[1] : 0;
+			}
+
+		bool empty(void) const { return num_active == 0; }
+		/* Stream index and key of the current winner. */
+		uint32_t top(void) const { return tree[0]; }
+		const Key& top_key(void) const { return keys[tree[0]]; }
+
+		/* The winner advanced to the next key in its stream. */
+		void replace_top(const Key& key) {
+			keys[tree[0]] = key;
+			replay(tree[0]);
+		}
+
+		/* The winner's stream is exhausted. */
+		void pop(void) {
+			uint32_t w = tree[0];
+			done[w] = 1;
+			keys[w] = std::numeric_limits<Key>::max();
+			num_active--;
+			replay(w);
+		}
+
+	private:
+		/* true if stream a wins the match against stream b. */
+		bool less(uint32_t a, uint32_t b) const {
+			if (keys[a] != keys[b])
+				return keys[a] < keys[b];
+			if (done[a] != done[b])
+				return done[b];
+			return a < b;
+		}
+
+		void replay(uint32_t w) {
+			for (uint32_t node = (w + k) >> 1; node > 0; node >>= 1)
+				if (less(tree[node], w))
+					std::swap(tree[node], w);
+			tree[0] = w;
+		}
+
+		std::vector<Key> keys;
+		std::vector<uint8_t> done;
+		std::vector<uint32_t> tree;
+		uint32_t k;
+		uint32_t num_active;
+};
+
+#endif
@@ -8,16 +8,20 @@ namespace mantis{
     constexpr char minor_version[] = "2";
     constexpr char patch_version[] = "0";
     constexpr char version[] = "0.2.0";
-    constexpr uint32_t index_version = 0;
+    constexpr uint32_t index_version = 1;
     constexpr char meta_file_name[] = "/meta_info.json";
     constexpr char CQF_FILE[] = "dbg_cqf.ser";
-    constexpr char EQCLASS_FILE[] = "eqclass_rrr.cls";
+    constexpr char EQCLASS_FILE[] = "eqclass_hybrid.cls";
     constexpr char SAMPLEID_FILE[] = "sampleid.lst";
     constexpr char PARENTBV_FILE[] = "parents.bv";
     constexpr char DELTABV_FILE[] = "deltas.bv";
     constexpr char BOUNDARYBV_FILE[] = "boundaries.bv";
+    constexpr char BOUNDARYSEL_FILE[] = "boundaries.sel";
 
+    // Default number of color classes per color class file. The number an
+    // index was built with is stored under NUM_BV_BUFFER_KEY in its metadata.
     constexpr const uint64_t NUM_BV_BUFFER{20000000};
+    constexpr char NUM_BV_BUFFER_KEY[] = "num_bv_buffer";
     constexpr const uint64_t INITIAL_EQ_CLASSES{10000};
     constexpr const uint64_t SAMPLE_SIZE{(1ULL << 26)};
 } // namespace mantis
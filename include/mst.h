@@ -21,6 +21,7 @@
 
 #include "canonicalKmer.h"
 #include "sdsl/bit_vectors.hpp"
+#include "colorclasses.h"
 #include "gqf/hashutil.h"
 
 #include "lru/lru.hpp"
@@ -147,14 +148,12 @@ private:
 
     std::set<workItem> neighbors(CQF<KeyObject> &cqf, workItem n);
 
-    bool exists(CQF<KeyObject> &cqf, dna::canonical_kmer e, uint64_t &eqid);
-
     uint64_t hammingDist(uint64_t eqid1, uint64_t eqid2,
                          uint64_t &srcId, std::vector<uint64_t> &srcEq);
 
     std::vector<uint32_t> getDeltaList(uint64_t eqid1, uint64_t eqid2);
 
-    void buildColor(std::vector<uint64_t> &eq, uint64_t eqid, BitVectorRRR *bv);
+    void buildColor(std::vector<uint64_t> &eq, uint64_t eqid, HybridColorClasses *bv);
 
     inline uint64_t getBucketId(uint64_t c1, uint64_t c2);
 
@@ -172,11 +171,12 @@ private:
     uint32_t numSamples = 0;
     uint64_t k;
     uint64_t num_of_ccBuffers;
+    uint64_t num_bv_buffer;
     uint64_t num_edges = 0;
     uint64_t num_colorClasses = 0;
     uint64_t mstTotalWeight = 0;
     colorIdType zero = static_cast<colorIdType>(UINT64_MAX);
-    BitVectorRRR *bvp1, *bvp2;
+    HybridColorClasses *bvp1, *bvp2;
     LRUCacheMap lru_cache;
     uint64_t gcntr = 0;
     std::vector<std::string> eqclass_files;
@@ -5,8 +5,11 @@
 #ifndef MANTIS_MSTQUERY_H
 #define MANTIS_MSTQUERY_H
 
+#include <memory>
+
 #include "spdlog/spdlog.h"
 #include "sdsl/bit_vectors.hpp"
+#include "sdsl/int_vector_mapper.hpp"
 #include "mantisconfig.hpp"
 #include "lru/lru.hpp"
 #include "gqf_cpp.h"
@@ -16,6 +19,15 @@
 
 using LRUCacheMap =  LRU::Cache<uint64_t, std::vector<uint64_t>>;
 
+/* The select structure over boundaries.bv is stored in BOUNDARYSEL_FILE,
+ * after the size and a checksum of the vector it was built over. */
+void store_boundary_select(const sdsl::bit_vector::select_1_type &sbbv,
+                           const sdsl::bit_vector &bbv, std::string filename);
+/* Loads the select structure stored for bbv. Returns false if the file is
+ * missing or was built over a different vector. */
+bool load_boundary_select(sdsl::bit_vector::select_1_type &sbbv,
+                          const sdsl::bit_vector &bbv, std::string filename);
+
 struct QueryStats {
     uint32_t cnt = 0, cacheCntr = 0, noCacheCntr{0};
     uint64_t totSel{0};
@@ -55,12 +67,40 @@ private:
     uint32_t maxRank_{0};
 };
 
+/* The MST color encoding of an index. It is not modified after loading, so
+ * MSTQuery objects on different threads can share one. */
+class MSTIndex {
+private:
+    // The MST vectors are mapped read-only from the index files. Nothing is
+    // read up front, and query processes on the same index share the pages.
+    sdsl::read_only_mapper<> parentbvMap;
+    sdsl::read_only_mapper<> deltabvMap;
+    sdsl::read_only_mapper<1> bbvMap;
+
+public:
+    const sdsl::int_vector<> &parentbv;
+    const sdsl::int_vector<> &deltabv;
+    const sdsl::bit_vector &bbv;
+    sdsl::bit_vector::select_1_type sbbv;
+
+    // With hugePages, asks for transparent huge pages on the mapped vectors.
+    MSTIndex(std::string prefix, spdlog::logger *logger,
+             bool hugePages = false);
+    MSTIndex(const MSTIndex &) = delete;
+    MSTIndex &operator=(const MSTIndex &) = delete;
+
+    // Reads every page of the mapped vectors. The pages that are not in the
+    // page cache yet are allocated under the memory policy of the caller.
+    void prefault() const;
+};
+
 class MSTQuery {
 private:
+    std::shared_ptr<const MSTIndex> index;
     uint64_t numSamples;
     uint64_t numWrds;
     uint32_t zero;
-    sdsl::bit_vector bbv;
+    const sdsl::bit_vector &bbv;
     spdlog::logger *logger{nullptr};
     mantis::QueryMap kmer2cidMap;
     mantis::EqMap cid2expMap;
@@ -68,18 +108,26 @@ private:
 public:
     uint32_t queryK;
     uint32_t indexK;
-    sdsl::int_vector<> parentbv;
-    sdsl::int_vector<> deltabv;
-    sdsl::bit_vector::select_1_type sbbv;
+    const sdsl::int_vector<> &parentbv;
+    const sdsl::int_vector<> &deltabv;
+    const sdsl::bit_vector::select_1_type &sbbv;
 
     MSTQuery(std::string prefix, uint32_t indexKIn, uint32_t queryKIn,
             uint64_t numSamplesIn, spdlog::logger *loggerIn) :
-    numSamples(numSamplesIn), indexK(indexKIn), queryK(queryKIn), logger(loggerIn) {
+    MSTQuery(std::make_shared<const MSTIndex>(prefix, loggerIn), indexKIn,
+             queryKIn, numSamplesIn, loggerIn) {}
+
+    // The k-mer and color maps of a query are per object; the index is shared.
+    MSTQuery(std::shared_ptr<const MSTIndex> indexIn, uint32_t indexKIn,
+             uint32_t queryKIn, uint64_t numSamplesIn,
+             spdlog::logger *loggerIn) :
+    index(indexIn), numSamples(numSamplesIn), bbv(index->bbv),
+    logger(loggerIn), queryK(queryKIn), indexK(indexKIn),
+    parentbv(index->parentbv), deltabv(index->deltabv), sbbv(index->sbbv) {
         numWrds = (uint64_t) std::ceil((double) numSamples / 64.0);
-        loadIdx(prefix);
+        zero = parentbv.size() - 1; // maximum color id which
     }
 
-    void loadIdx(std::string indexDir);
     std::vector<uint64_t> buildColor(uint64_t eqid, QueryStats &queryStats,
                                      LRUCacheMap *lru_cache,
                                      RankScores* rs,
@@ -102,4 +150,44 @@ public:
     }
 };
 
+/* The state of one query thread. The index and the CQF are shared between
+ * threads; the color class cache is per thread. */
+struct QueryWorker {
+    QueryWorker(std::shared_ptr<const MSTIndex> index, uint32_t indexK,
+                uint32_t queryK, uint64_t numSamples, spdlog::logger *logger) :
+    mstQuery(index, indexK, queryK, numSamples, logger), cache_lru(100000),
+    rs(1) {
+        queryStats.numSamples = numSamples;
+    }
+
+    MSTQuery mstQuery;
+    LRUCacheMap cache_lru;
+    RankScores rs;
+    QueryStats queryStats;
+    // The NUMA node to run the worker on, or -1 to let it run anywhere.
+    int32_t numaNode{-1};
+};
+
+/* With numa, makes the memory that the calling thread allocates from now on
+ * spread over the NUMA nodes, so that an index loaded next is not all on one
+ * node. Returns the nodes, or none if there is only one. */
+std::vector<uint32_t> interleave_index_memory(bool numa,
+                                              spdlog::logger *logger);
+/* Goes back to allocating on the local node and assigns the workers to the
+ * nodes round-robin. */
+void place_workers(const std::vector<uint32_t> &nodes,
+                   std::vector<std::unique_ptr<QueryWorker>> &workers,
+                   spdlog::logger *logger);
+
+/* Queries one sequence and writes its result to opfile in the TSV or, with
+ * use_json, the JSON format of mantis query. A JSON result is an element of
+ * an array and is preceded by a comma unless it is the first one. */
+void query_sequence(std::string &read, MSTQuery &mstQuery,
+                    CQF<KeyObject> &cqf, LRUCacheMap &cache_lru,
+                    RankScores &rs, QueryStats &queryStats,
+                    std::vector<std::string> &sampleNames, bool use_json,
+                    bool first, std::ostream &opfile);
+/* Sample names indexed by sample id, read from sampleid.lst. */
+std::vector<std::string> loadSampleFile(const std::string &sampleFileAddr);
+
 #endif //MANTIS_MSTQUERY_H
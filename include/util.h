@@ -18,6 +18,8 @@
 
 #include <inttypes.h>
 
+#include "spdlog/spdlog.h"
+
 #ifdef DEBUG
 #define PRINT_DEBUG 1
 #else
@@ -70,6 +72,14 @@ class LightweightLock {
 
 std::string last_part(std::string str, char c);
 std::string first_part(std::string str, char c);
+/* The number of color classes per color class file of the index in prefix.
+ * Indexes that do not record it use mantis::NUM_BV_BUFFER. */
+uint64_t read_num_bv_buffer(std::string prefix);
+/* Exits with an error if the index in prefix was built for another index
+ * version than mantis::index_version, which this mantis can't read. */
+void check_index_version(std::string prefix, spdlog::logger* logger);
+/* Resident set size of this process in bytes. */
+uint64_t get_resident_bytes(void);
 /* Print elapsed time using the start and end timeval */
 void print_time_elapsed(std::string desc, struct timeval* start, struct
 												timeval* end);
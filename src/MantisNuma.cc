@@ -0,0 +1,75 @@
+#include "MantisNuma.h"
+#include <fstream>
+#include <sstream>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace mantis {
+	namespace numa {
+
+		// Parses a sysfs list such as "0-3,8,10-11".
+		static std::vector<uint32_t> ReadList(const std::string& path)
+		{
+			std::vector<uint32_t> ids;
+			std::ifstream in(path);
+			std::string range;
+			while (std::getline(in, range, ',')) {
+				std::istringstream r(range);
+				uint32_t first, last;
+				char dash;
+				if (!(r >> first))
+					continue;
+				last = first;
+				if (r >> dash >> last && dash != '-')
+					last = first;
+				for (uint32_t id = first; id <= last; id++)
+					ids.push_back(id);
+			}
+			return ids;
+		}
+
+		std::vector<uint32_t> Nodes()
+		{
+			return ReadList("/sys/devices/system/node/has_memory");
+		}
+
+		// The policy calls are made directly so that mantis does not need
+		// libnuma.
+		bool InterleaveMemory(const std::vector<uint32_t>& nodes)
+		{
+			const uint64_t bits = 8 * sizeof(unsigned long);
+			std::vector<unsigned long> mask;
+			for (auto node : nodes) {
+				if (mask.size() <= node / bits)
+					mask.resize(node / bits + 1, 0);
+				mask[node / bits] |= 1UL << (node % bits);
+			}
+			if (mask.empty())
+				return false;
+			return syscall(SYS_set_mempolicy, MPOL_INTERLEAVE, mask.data(),
+										 mask.size() * bits + 1) == 0;
+		}
+
+		bool LocalMemory()
+		{
+			return syscall(SYS_set_mempolicy, MPOL_DEFAULT, nullptr, 0) == 0;
+		}
+
+		bool PinToNode(uint32_t node)
+		{
+			std::vector<uint32_t> cpus = ReadList("/sys/devices/system/node/node" +
+																						std::to_string(node) + "/cpulist");
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			for (auto cpu : cpus)
+				if (cpu < CPU_SETSIZE)
+					CPU_SET(cpu, &set);
+			if (CPU_COUNT(&set) == 0)
+				return false;
+			return sched_setaffinity(0, sizeof(set), &set) == 0;
+		}
+
+	}
+}
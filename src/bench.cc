@@ -0,0 +1,682 @@
+/*
+ * ============================================================================
+ *       Filename:  bench.cc
+ *
+ *    Description:  Micro-benchmarks for the building blocks of mantis.
+ *                  Not built by default; configure with -DBUILD_BENCHMARKS=1.
+ * ============================================================================
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <random>
+
+#include <string.h>
+#include <inttypes.h>
+
+#include "gqf/gqf.h"
+#include "gqf/gqf_int.h"
+#include "gqf/hashutil.h"
+#include "loser_tree.h"
+
+/*
+ * Merge benchmark: builds num_inputs in-memory CQFs with keys_per_input k-mers
+ * each, drawn from a shared pool so that k-mers are present in several inputs,
+ * and merges them the way ColoredDbg::construct does. Reports the merge rate
+ * for the loser tree and for the binary heap it replaced.
+ */
+struct MergeIterator {
+	QFi qfi;
+	uint64_t kmer;
+	uint32_t id;
+	MergeIterator(uint32_t id, const QF* cqf) : id(id) {
+		qf_iterator_from_position(cqf, &qfi, 0);
+		get_key();
+	}
+	bool next() {
+		if (qfi_next(&qfi) == QFI_INVALID) return false;
+		get_key();
+		return true;
+	}
+	bool end() const { return qfi_end(&qfi); }
+	bool operator>(const MergeIterator& rhs) const { return kmer > rhs.kmer; }
+	private:
+	void get_key() {
+		uint64_t value, count;
+		if (!qfi_end(&qfi))
+			qfi_get_hash(&qfi, &kmer, &value, &count);
+	}
+};
+
+static uint64_t merge_loser_tree(std::vector<QF>& qfs) {
+	std::vector<MergeIterator> iters;
+	std::vector<uint64_t> keys;
+	for (uint32_t i = 0; i < qfs.size(); i++) {
+		MergeIterator it(i, &qfs[i]);
+		if (it.end()) continue;
+		iters.push_back(it);
+		keys.push_back(it.kmer);
+	}
+	LoserTree<uint64_t> tree(keys);
+	uint64_t num_distinct = 0;
+	while (!tree.empty()) {
+		uint64_t last_key;
+		do {
+			MergeIterator& cur = iters[tree.top()];
+			last_key = cur.kmer;
+			if (cur.next())
+				tree.replace_top(cur.kmer);
+			else
+				tree.pop();
+		} while (!tree.empty() && last_key == tree.top_key());
+		num_distinct++;
+	}
+	return num_distinct;
+}
+
+static uint64_t merge_binary_heap(std::vector<QF>& qfs) {
+	std::vector<MergeIterator> heap;
+	auto cmp = std::greater<MergeIterator>();
+	for (uint32_t i = 0; i < qfs.size(); i++) {
+		MergeIterator it(i, &qfs[i]);
+		if (it.end()) continue;
+		heap.emplace_back(it);
+		std::push_heap(heap.begin(), heap.end(), cmp);
+	}
+	uint64_t num_distinct = 0;
+	while (!heap.empty()) {
+		uint64_t last_key;
+		do {
+			MergeIterator& cur = heap.front();
+			last_key = cur.kmer;
+			if (cur.next()) {
+				heap.emplace_back(cur);
+				std::pop_heap(heap.begin(), heap.end(), cmp);
+				heap.pop_back();
+			} else {
+				std::pop_heap(heap.begin(), heap.end(), cmp);
+				heap.pop_back();
+			}
+		} while (!heap.empty() && last_key == heap.front().kmer);
+		num_distinct++;
+	}
+	return num_distinct;
+}
+
+static int merge_bench(int argc, char *argv[]) {
+	std::vector<uint32_t> input_counts{100, 1000, 10000};
+	uint64_t keys_per_input = 4096;
+	// Each k-mer is present in about this many inputs.
+	uint64_t sharing = 8;
+	if (argc > 0) {
+		input_counts.clear();
+		for (int i = 0; i < argc - 1; i++)
+			input_counts.push_back(std::stoul(argv[i]));
+		keys_per_input = std::stoull(argv[argc - 1]);
+	}
+
+	const uint64_t key_bits = 40;
+	const uint32_t seed = 2038074761;
+	uint64_t qbits = 1;
+	while ((1ULL << qbits) < keys_per_input * 1.2)
+		qbits++;
+
+	std::cout << "inputs\tkmers\tdistinct\theap (M kmers/s)\tloser tree (M kmers/s)\n";
+	for (uint32_t num_inputs : input_counts) {
+		uint64_t pool_size = std::max((uint64_t)1, num_inputs * keys_per_input /
+																	sharing);
+		std::mt19937_64 rng(num_inputs);
+		std::uniform_int_distribution<uint64_t> pick(0, pool_size - 1);
+
+		std::vector<QF> qfs(num_inputs);
+		uint64_t total = 0;
+		for (uint32_t i = 0; i < num_inputs; i++) {
+			if (!qf_malloc(&qfs[i], 1ULL << qbits, key_bits, 0, QF_HASH_INVERTIBLE,
+										 seed)) {
+				std::cerr << "Can't allocate the CQF\n";
+				return 1;
+			}
+			for (uint64_t j = 0; j < keys_per_input; j++) {
+				uint64_t kmer = pick(rng);
+				uint64_t hash = MurmurHash64A(&kmer, sizeof(kmer), seed) &
+					((1ULL << key_bits) - 1);
+				qf_insert(&qfs[i], hash, 0, 1, QF_NO_LOCK | QF_KEY_IS_HASH);
+			}
+			total += qf_get_num_distinct_key_value_pairs(&qfs[i]);
+		}
+
+		auto time_merge = [&](uint64_t (*merge)(std::vector<QF>&),
+													uint64_t& num_distinct) {
+			auto start = std::chrono::high_resolution_clock::now();
+			num_distinct = merge(qfs);
+			std::chrono::duration<double> secs =
+				std::chrono::high_resolution_clock::now() - start;
+			return total / secs.count() / 1e6;
+		};
+		uint64_t heap_distinct, tree_distinct;
+		double heap_rate = time_merge(merge_binary_heap, heap_distinct);
+		double tree_rate = time_merge(merge_loser_tree, tree_distinct);
+		for (auto& qf : qfs)
+			qf_free(&qf);
+		if (heap_distinct != tree_distinct) {
+			std::cerr << "Merge results differ: " << heap_distinct << " vs " <<
+				tree_distinct << "\n";
+			return 1;
+		}
+		std::cout << num_inputs << "\t" << total << "\t" << tree_distinct << "\t" <<
+			heap_rate << "\t" << tree_rate << "\n";
+	}
+	return 0;
+}
+
+/*
+ * Append benchmark: fills a CQF with num_kmers sorted hashes whose counts are
+ * eq class ids, once with the query-then-insert pair the build used to do
+ * and once with qf_append_sorted. Checks that both give the same CQF and
+ * reports the insert rate of each.
+ */
+/* About num_kmers distinct sorted key_bits-bit hashes, each with an eq class
+ * id as its count. A few small ids cover many k-mers, as after the build
+ * renumbers the eq classes by abundance. */
+static std::vector<std::pair<uint64_t, uint64_t>> sorted_kmers(uint64_t
+																															 num_kmers,
+																															 uint64_t
+																															 key_bits) {
+	std::mt19937_64 rng(num_kmers);
+	std::uniform_int_distribution<uint64_t> pick(0, (1ULL << key_bits) - 1);
+	std::geometric_distribution<uint64_t> eq_id(0.01);
+	std::vector<std::pair<uint64_t, uint64_t>> kmers(num_kmers);
+	for (auto& kmer : kmers)
+		kmer = std::make_pair(pick(rng), eq_id(rng) + 1);
+	std::sort(kmers.begin(), kmers.end());
+	kmers.erase(std::unique(kmers.begin(), kmers.end(),
+													[](const std::pair<uint64_t, uint64_t>& a,
+														 const std::pair<uint64_t, uint64_t>& b) {
+														return a.first == b.first; }), kmers.end());
+	return kmers;
+}
+
+static int append_bench(int argc, char *argv[]) {
+	uint64_t num_kmers = argc > 0 ? std::stoull(argv[0]) : 1ULL << 24;
+	const uint64_t key_bits = 40;
+	const uint32_t seed = 2038074761;
+	// Ids above 3 take three slots. The keys come in sorted order, so a CQF
+	// without room for all of them spills far from the home slots early on.
+	uint64_t qbits = 1;
+	while ((1ULL << qbits) * 0.8 < num_kmers * 3)
+		qbits++;
+	std::vector<std::pair<uint64_t, uint64_t>> kmers = sorted_kmers(num_kmers,
+																																	key_bits);
+
+	auto time_fill = [&](QF& qf, bool append) {
+		if (!qf_malloc(&qf, 1ULL << qbits, key_bits, 0, QF_HASH_INVERTIBLE,
+									 seed)) {
+			std::cerr << "Can't allocate the CQF\n";
+			exit(1);
+		}
+		auto start = std::chrono::high_resolution_clock::now();
+		for (auto& kmer : kmers) {
+			int ret;
+			if (append) {
+				ret = qf_append_sorted(&qf, kmer.first, 0, kmer.second, QF_NO_LOCK |
+															 QF_KEY_IS_HASH);
+			} else {
+				if (qf_count_key_value(&qf, kmer.first, 0, QF_KEY_IS_HASH) > 0) {
+					std::cerr << "K-mer was already present\n";
+					exit(1);
+				}
+				ret = qf_insert(&qf, kmer.first, 0, kmer.second, QF_NO_LOCK |
+												QF_KEY_IS_HASH);
+			}
+			if (ret < 0) {
+				std::cerr << "The CQF is full\n";
+				exit(1);
+			}
+		}
+		std::chrono::duration<double> secs =
+			std::chrono::high_resolution_clock::now() - start;
+		return kmers.size() / secs.count() / 1e6;
+	};
+	QF insert_qf, append_qf;
+	double insert_rate = time_fill(insert_qf, false);
+	double append_rate = time_fill(append_qf, true);
+
+	bool same = qf_get_num_occupied_slots(&insert_qf) ==
+		qf_get_num_occupied_slots(&append_qf) &&
+		qf_get_num_distinct_key_value_pairs(&insert_qf) ==
+		qf_get_num_distinct_key_value_pairs(&append_qf) &&
+		memcmp(insert_qf.blocks, append_qf.blocks,
+					 insert_qf.metadata->total_size_in_bytes) == 0;
+	qf_free(&insert_qf);
+	qf_free(&append_qf);
+	if (!same) {
+		std::cerr << "The appended CQF differs from the inserted one\n";
+		return 1;
+	}
+	std::cout << "kmers\tslots\tquery+insert (M kmers/s)\tappend (M kmers/s)\n";
+	std::cout << kmers.size() << "\t" << (1ULL << qbits) << "\t" << insert_rate <<
+		"\t" << append_rate << "\n";
+	return 0;
+}
+
+/*
+ * Resize benchmark: fills a CQF with about num_kmers k-mers to the load at
+ * which the build resizes it and doubles it with each number of threads.
+ * Reports the copy rate next to the one of the single-threaded qf_insert loop
+ * the resize used before, and checks that all of them give the same CQF.
+ * With value bits, a k-mer has up to three values, so the resize has to keep
+ * apart the items of a key that spill out of a range and the ones that do not.
+ */
+static int resize_bench(int argc, char *argv[]) {
+	uint64_t num_kmers = argc > 0 ? std::stoull(argv[0]) : 1ULL << 24;
+	// Items only spill out of a range near its end, so the many ranges of 64
+	// threads are the ones that check how the left over items are copied.
+	std::vector<uint32_t> thread_counts{1, 2, 4, 8, 64};
+	if (argc > 1) {
+		thread_counts.clear();
+		for (int i = 1; i < argc; i++)
+			thread_counts.push_back(std::stoul(argv[i]));
+	}
+	const uint64_t key_bits = 40;
+	const uint32_t seed = 2038074761;
+	std::vector<std::pair<uint64_t, uint64_t>> kmers = sorted_kmers(num_kmers,
+																																	key_bits);
+
+	std::cout << "kmers\tvalue bits\tslots\tload\tthreads\tresize (M items/s)\n";
+	for (uint64_t value_bits : {0, 4}) {
+		uint64_t num_items = 0;
+		auto fill = [&](QF& qf, uint64_t nslots) {
+			if (!qf_malloc(&qf, nslots, key_bits, value_bits, QF_HASH_INVERTIBLE,
+										 seed)) {
+				std::cerr << "Can't allocate the CQF\n";
+				exit(1);
+			}
+			num_items = 0;
+			for (auto& kmer : kmers) {
+				uint64_t num_values = value_bits > 0 ? 1 + kmer.first % 3 : 1;
+				for (uint64_t value = 0; value < num_values; value++, num_items++)
+					if (qf_append_sorted(&qf, kmer.first, value, kmer.second,
+															 QF_NO_LOCK | QF_KEY_IS_HASH) < 0) {
+						std::cerr << "The CQF is full\n";
+						exit(1);
+					}
+			}
+		};
+		// The smallest CQF that holds the k-mers under the 95% load cutoff.
+		QF qf;
+		uint64_t nslots = 64;
+		while (nslots * 0.8 < kmers.size() * 3 * (value_bits > 0 ? 3 : 1))
+			nslots *= 2;
+		fill(qf, nslots);
+		uint64_t used_slots = qf_get_num_occupied_slots(&qf);
+		qf_free(&qf);
+		while (nslots / 2 * 0.95 > used_slots && nslots > 64)
+			nslots /= 2;
+
+		// What the resize did before: one qf_insert per key on a single thread.
+		fill(qf, nslots);
+		QF expected;
+		qf_malloc(&expected, nslots * 2, key_bits, value_bits, QF_HASH_INVERTIBLE,
+							seed);
+		auto start = std::chrono::high_resolution_clock::now();
+		QFi qfi;
+		qf_iterator_from_position(&qf, &qfi, 0);
+		while (!qfi_end(&qfi)) {
+			uint64_t key, value, count;
+			qfi_get_hash(&qfi, &key, &value, &count);
+			qf_insert(&expected, key, value, count, QF_NO_LOCK | QF_KEY_IS_HASH);
+			qfi_next(&qfi);
+		}
+		std::chrono::duration<double> secs =
+			std::chrono::high_resolution_clock::now() - start;
+		qf_free(&qf);
+
+		std::cout << kmers.size() << "\t" << value_bits << "\t" << nslots << "\t"
+			<< used_slots / (double)nslots << "\tinsert\t" << num_items /
+			secs.count() / 1e6 << "\n";
+		for (uint32_t num_threads : thread_counts) {
+			fill(qf, nslots);
+			qf_set_resize_threads(&qf, num_threads);
+			start = std::chrono::high_resolution_clock::now();
+			if (qf_resize_malloc(&qf, nslots * 2) < 0) {
+				std::cerr << "Resize failed\n";
+				return 1;
+			}
+			secs = std::chrono::high_resolution_clock::now() - start;
+			bool same = qf_get_num_occupied_slots(&qf) ==
+				qf_get_num_occupied_slots(&expected) &&
+				memcmp(qf.blocks, expected.blocks,
+							 expected.metadata->total_size_in_bytes) == 0;
+			qf_free(&qf);
+			if (!same) {
+				std::cerr << "The CQF with " << value_bits <<
+					" value bits resized with " << num_threads <<
+					" threads differs from the inserted one\n";
+				return 1;
+			}
+			std::cout << kmers.size() << "\t" << value_bits << "\t" << nslots <<
+				"\t" << used_slots / (double)nslots << "\t" << num_threads << "\t" <<
+				num_items / secs.count() / 1e6 << "\n";
+		}
+		qf_free(&expected);
+	}
+	return 0;
+}
+
+/*
+ * Lookup benchmark: fills a CQF with about num_kmers k-mers and looks up as
+ * many random keys, half of them present, with qf_count_key_value one at a
+ * time and with qf_count_key_value_batch in batches of each size. Reports the
+ * lookup rate of each and checks that the counts agree.
+ */
+static int lookup_bench(int argc, char *argv[]) {
+	uint64_t num_kmers = argc > 0 ? std::stoull(argv[0]) : 1ULL << 24;
+	std::vector<uint64_t> batch_sizes{8, 64, 1024, 1ULL << 20};
+	if (argc > 1) {
+		batch_sizes.clear();
+		for (int i = 1; i < argc; i++)
+			batch_sizes.push_back(std::stoull(argv[i]));
+	}
+	const uint64_t key_bits = 40;
+	const uint32_t seed = 2038074761;
+	std::vector<std::pair<uint64_t, uint64_t>> kmers = sorted_kmers(num_kmers,
+																																	key_bits);
+	QF qf;
+	uint64_t nslots = 64;
+	while (nslots * 0.8 < kmers.size() * 3)
+		nslots *= 2;
+	if (!qf_malloc(&qf, nslots, key_bits, 0, QF_HASH_INVERTIBLE, seed)) {
+		std::cerr << "Can't allocate the CQF\n";
+		exit(1);
+	}
+	for (auto& kmer : kmers)
+		if (qf_append_sorted(&qf, kmer.first, 0, kmer.second, QF_NO_LOCK |
+												 QF_KEY_IS_HASH) < 0) {
+			std::cerr << "The CQF is full\n";
+			exit(1);
+		}
+
+	std::mt19937_64 rng(seed);
+	std::uniform_int_distribution<uint64_t> pick(0, (1ULL << key_bits) - 1);
+	std::vector<uint64_t> keys(kmers.size());
+	for (uint64_t i = 0; i < keys.size(); i++)
+		keys[i] = i % 2 ? pick(rng) : kmers[rng() % kmers.size()].first;
+
+	std::vector<uint64_t> expected(keys.size());
+	auto start = std::chrono::high_resolution_clock::now();
+	for (uint64_t i = 0; i < keys.size(); i++)
+		expected[i] = qf_count_key_value(&qf, keys[i], 0, QF_KEY_IS_HASH);
+	std::chrono::duration<double> secs =
+		std::chrono::high_resolution_clock::now() - start;
+
+	std::cout << "kmers\tslots\tbatch\tlookup (M keys/s)\n";
+	std::cout << kmers.size() << "\t" << nslots << "\t1\t" << keys.size() /
+		secs.count() / 1e6 << "\n";
+	std::vector<uint64_t> counts(keys.size());
+	for (uint64_t batch_size : batch_sizes) {
+		start = std::chrono::high_resolution_clock::now();
+		for (uint64_t i = 0; i < keys.size(); i += batch_size)
+			qf_count_key_value_batch(&qf, keys.data() + i, NULL,
+															 std::min(batch_size, keys.size() - i),
+															 counts.data() + i, QF_KEY_IS_HASH);
+		secs = std::chrono::high_resolution_clock::now() - start;
+		if (counts != expected) {
+			std::cerr << "The batch lookup of size " << batch_size <<
+				" differs from qf_count_key_value\n";
+			return 1;
+		}
+		std::cout << kmers.size() << "\t" << nslots << "\t" << batch_size <<
+			"\t" << keys.size() / secs.count() / 1e6 << "\n";
+	}
+	qf_free(&qf);
+	return 0;
+}
+
+/*
+ * Huge page benchmark: fills a CQF with about num_kmers k-mers, once in
+ * normal pages and once with qf_set_huge_pages, and looks up as many random
+ * keys in each. Reports the pages each CQF got and its lookup rate.
+ */
+static int hugepages_bench(int argc, char *argv[]) {
+	uint64_t num_kmers = argc > 0 ? std::stoull(argv[0]) : 1ULL << 24;
+	const uint64_t key_bits = 40;
+	const uint32_t seed = 2038074761;
+	std::vector<std::pair<uint64_t, uint64_t>> kmers = sorted_kmers(num_kmers,
+																																	key_bits);
+	uint64_t nslots = 64;
+	while (nslots * 0.8 < kmers.size() * 3)
+		nslots *= 2;
+	std::mt19937_64 rng(seed);
+	std::vector<uint64_t> keys(kmers.size());
+	for (auto& key : keys)
+		key = kmers[rng() % kmers.size()].first;
+
+	std::cout << "kmers\tslots\tpages\tlookup (M keys/s)\n";
+	uint64_t expected = 0;
+	for (bool huge_pages : {false, true}) {
+		qf_set_huge_pages(huge_pages);
+		QF qf;
+		if (!qf_malloc(&qf, nslots, key_bits, 0, QF_HASH_INVERTIBLE, seed)) {
+			std::cerr << "Can't allocate the CQF\n";
+			exit(1);
+		}
+		for (auto& kmer : kmers)
+			if (qf_append_sorted(&qf, kmer.first, 0, kmer.second, QF_NO_LOCK |
+													 QF_KEY_IS_HASH) < 0) {
+				std::cerr << "The CQF is full\n";
+				exit(1);
+			}
+		uint64_t sum = 0;
+		auto start = std::chrono::high_resolution_clock::now();
+		for (auto key : keys)
+			sum += qf_count_key_value(&qf, key, 0, QF_KEY_IS_HASH);
+		std::chrono::duration<double> secs =
+			std::chrono::high_resolution_clock::now() - start;
+		if (huge_pages && sum != expected) {
+			std::cerr << "The CQF in huge pages gives different counts\n";
+			return 1;
+		}
+		expected = sum;
+		std::cout << kmers.size() << "\t" << nslots << "\t" <<
+			qf_pages_name(qf_get_pages(&qf)) << "\t" << keys.size() / secs.count()
+			/ 1e6 << "\n";
+		qf_free(&qf);
+	}
+	qf_set_huge_pages(false);
+	return 0;
+}
+
+/*
+ * Bit operation benchmark: inserts about num_kmers k-mers in random order into
+ * a CQF and looks up as many random keys, once with each set of rank and
+ * select instructions that the CPU has (see qf_set_bitops). Every variant must
+ * build the same CQF and find the same counts.
+ */
+static int bitops_bench(int argc, char *argv[]) {
+	uint64_t num_kmers = argc > 0 ? std::stoull(argv[0]) : 1ULL << 22;
+	const uint64_t key_bits = 40;
+	const uint32_t seed = 2038074761;
+	std::vector<std::pair<uint64_t, uint64_t>> kmers = sorted_kmers(num_kmers,
+																																	key_bits);
+	uint64_t nslots = 64;
+	while (nslots * 0.8 < kmers.size() * 3)
+		nslots *= 2;
+	std::mt19937_64 rng(seed);
+	std::shuffle(kmers.begin(), kmers.end(), rng);
+	std::uniform_int_distribution<uint64_t> pick(0, (1ULL << key_bits) - 1);
+	std::vector<uint64_t> keys(kmers.size());
+	for (uint64_t i = 0; i < keys.size(); i++)
+		keys[i] = i % 2 ? pick(rng) : kmers[rng() % kmers.size()].first;
+
+	enum qf_bitops picked = qf_get_bitops();
+	std::cout << "picked at startup: " << qf_bitops_name(picked) << "\n";
+	std::cout << "kmers\tslots\tbitops\tinsert (M keys/s)\tlookup (M keys/s)\n";
+	QF expected;
+	uint64_t expected_sum = 0;
+	bool first = true;
+	for (enum qf_bitops bitops : {QF_BITOPS_GENERIC, QF_BITOPS_POPCNT,
+			 QF_BITOPS_BMI2}) {
+		if (!qf_set_bitops(bitops)) {
+			std::cout << kmers.size() << "\t" << nslots << "\t" <<
+				qf_bitops_name(bitops) << "\tnot supported by this CPU\n";
+			continue;
+		}
+		QF qf;
+		if (!qf_malloc(&qf, nslots, key_bits, 0, QF_HASH_INVERTIBLE, seed)) {
+			std::cerr << "Can't allocate the CQF\n";
+			exit(1);
+		}
+		auto start = std::chrono::high_resolution_clock::now();
+		for (auto& kmer : kmers)
+			if (qf_insert(&qf, kmer.first, 0, kmer.second, QF_NO_LOCK |
+										QF_KEY_IS_HASH) < 0) {
+				std::cerr << "The CQF is full\n";
+				exit(1);
+			}
+		std::chrono::duration<double> insert_secs =
+			std::chrono::high_resolution_clock::now() - start;
+		uint64_t sum = 0;
+		start = std::chrono::high_resolution_clock::now();
+		for (auto key : keys)
+			sum += qf_count_key_value(&qf, key, 0, QF_KEY_IS_HASH);
+		std::chrono::duration<double> lookup_secs =
+			std::chrono::high_resolution_clock::now() - start;
+
+		if (first) {
+			expected = qf;
+			expected_sum = sum;
+			first = false;
+		} else {
+			bool same = sum == expected_sum && memcmp(qf.blocks, expected.blocks,
+																								qf.metadata->total_size_in_bytes)
+				== 0;
+			qf_free(&qf);
+			if (!same) {
+				std::cerr << "The CQF built with " << qf_bitops_name(bitops) <<
+					" differs from the one built with generic instructions\n";
+				return 1;
+			}
+		}
+		std::cout << kmers.size() << "\t" << nslots << "\t" <<
+			qf_bitops_name(bitops) << "\t" << kmers.size() / insert_secs.count() /
+			1e6 << "\t" << keys.size() / lookup_secs.count() / 1e6 << "\n";
+	}
+	qf_free(&expected);
+	qf_set_bitops(picked);
+	return 0;
+}
+
+/*
+ * Slot width benchmark: fills a CQF with num_kmers k-mers for each of a few
+ * slot widths, by giving the keys as many bits more than the log of the number
+ * of slots, and reports the lookup rate and the iteration rate. 27 is not one
+ * of the widths that gqf.c specializes, so it shows the generic code.
+ */
+static int slots_bench(int argc, char *argv[]) {
+	uint64_t num_kmers = argc > 0 ? std::stoull(argv[0]) : 1ULL << 22;
+	const uint32_t seed = 2038074761;
+	uint64_t nslots = 64, qbits = 6;
+	while (nslots * 0.8 < num_kmers * 3) {
+		nslots *= 2;
+		qbits++;
+	}
+
+	std::cout << "kmers\tslots\twidth\tlookup (M keys/s)\titerate (M keys/s)\n";
+	for (uint64_t width : {8, 16, 20, 27, 32}) {
+		uint64_t key_bits = qbits + width;
+		std::vector<std::pair<uint64_t, uint64_t>> kmers = sorted_kmers(num_kmers,
+																																		key_bits);
+		QF qf;
+		if (!qf_malloc(&qf, nslots, key_bits, 0, QF_HASH_INVERTIBLE, seed)) {
+			std::cerr << "Can't allocate the CQF\n";
+			exit(1);
+		}
+		for (auto& kmer : kmers)
+			if (qf_append_sorted(&qf, kmer.first, 0, kmer.second, QF_NO_LOCK |
+													 QF_KEY_IS_HASH) < 0) {
+				std::cerr << "The CQF is full\n";
+				exit(1);
+			}
+
+		std::mt19937_64 rng(seed);
+		std::vector<uint64_t> keys(kmers.size());
+		for (auto& key : keys)
+			key = kmers[rng() % kmers.size()].first;
+		auto start = std::chrono::high_resolution_clock::now();
+		uint64_t found = 0;
+		for (auto key : keys)
+			found += qf_count_key_value(&qf, key, 0, QF_KEY_IS_HASH) > 0;
+		std::chrono::duration<double> lookup_secs =
+			std::chrono::high_resolution_clock::now() - start;
+
+		start = std::chrono::high_resolution_clock::now();
+		QFi qfi;
+		uint64_t i = 0;
+		bool same = true;
+		qf_iterator_from_position(&qf, &qfi, 0);
+		while (!qfi_end(&qfi)) {
+			uint64_t key, value, count;
+			qfi_get_hash(&qfi, &key, &value, &count);
+			same &= i < kmers.size() && key == kmers[i].first && count ==
+				kmers[i].second;
+			i++;
+			qfi_next(&qfi);
+		}
+		std::chrono::duration<double> iterate_secs =
+			std::chrono::high_resolution_clock::now() - start;
+		if (found != keys.size()) {
+			std::cerr << "Lookups in the CQF with " << width <<
+				"-bit slots miss inserted k-mers\n";
+			return 1;
+		}
+		if (!same || i != kmers.size()) {
+			std::cerr << "Iterating the CQF with " << width <<
+				"-bit slots doesn't give the inserted k-mers\n";
+			return 1;
+		}
+
+		std::cout << kmers.size() << "\t" << nslots << "\t" <<
+			qf_get_bits_per_slot(&qf) << "\t" << keys.size() / lookup_secs.count() /
+			1e6 << "\t" << kmers.size() / iterate_secs.count() / 1e6 << "\n";
+		qf_free(&qf);
+	}
+	return 0;
+}
+
+static void usage(void) {
+	std::cerr << "usage: mantis_bench merge [<num_inputs>... <kmers_per_input>]\n";
+	std::cerr << "       mantis_bench append [<num_kmers>]\n";
+	std::cerr << "       mantis_bench resize [<num_kmers> [<num_threads>...]]\n";
+	std::cerr << "       mantis_bench lookup [<num_kmers> [<batch_size>...]]\n";
+	std::cerr << "       mantis_bench hugepages [<num_kmers>]\n";
+	std::cerr << "       mantis_bench bitops [<num_kmers>]\n";
+	std::cerr << "       mantis_bench slots [<num_kmers>]\n";
+}
+
+int main(int argc, char *argv[]) {
+	if (argc < 2) {
+		usage();
+		return 1;
+	}
+	std::string mode(argv[1]);
+	if (mode == "merge")
+		return merge_bench(argc - 2, argv + 2);
+	if (mode == "append")
+		return append_bench(argc - 2, argv + 2);
+	if (mode == "resize")
+		return resize_bench(argc - 2, argv + 2);
+	if (mode == "lookup")
+		return lookup_bench(argc - 2, argv + 2);
+	if (mode == "hugepages")
+		return hugepages_bench(argc - 2, argv + 2);
+	if (mode == "bitops")
+		return bitops_bench(argc - 2, argv + 2);
+	if (mode == "slots")
+		return slots_bench(argc - 2, argv + 2);
+	usage();
+	return 1;
+}
@@ -0,0 +1,144 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  colorclasses.cc
+ *
+ *    Description:  Hybrid dense/delta/run-length color class table.
+ *
+ * ============================================================================
+ */
+
+#include <vector>
+
+#include "colorclasses.h"
+
+/* Calls f with the run lengths of the RUN_LENGTH form of the class with the
+ * sorted sample ids in ids. The first run (of 0s) can be empty so it is
+ * passed as its length plus one. */
+template <typename F>
+static void for_each_run(const std::vector<uint64_t>& ids, uint64_t
+												 num_samples, F f) {
+	f((ids.empty() ? num_samples : ids[0]) + 1);
+	for (uint64_t j = 0; j < ids.size(); ) {
+		uint64_t k = j + 1;
+		while (k < ids.size() && ids[k] == ids[k - 1] + 1)
+			k++;
+		f(k - j);
+		uint64_t next = k < ids.size() ? ids[k] : num_samples;
+		if (next > ids[k - 1] + 1)
+			f(next - ids[k - 1] - 1);
+		j = k;
+	}
+}
+
+HybridColorClasses::HybridColorClasses(const sdsl::bit_vector& rows, uint64_t
+																			 num_samples) :
+	m_num_samples(num_samples) {
+	uint64_t num_classes = num_samples ? rows.size() / num_samples : 0;
+	m_encodings = sdsl::int_vector<2>(num_classes, DENSE);
+	// No class takes more than num_samples bits in the form picked for it. So
+	// the table is never bigger than rows.
+	m_offsets = sdsl::int_vector<>(num_classes + 1, 0,
+																 sdsl::bits::hi(rows.size() + 1) + 1);
+	m_data = sdsl::bit_vector(rows.size() + 64, 0);
+
+	std::vector<uint64_t> ids;
+	uint64_t pos = 0;
+	for (uint64_t i = 0; i < num_classes; i++) {
+		uint64_t start = i * num_samples;
+		ids.clear();
+		for (uint64_t j = 0; j < num_samples; j += 64) {
+			uint64_t wrd = rows.get_int(start + j, std::min((uint64_t)64,
+																											num_samples - j));
+			for (; wrd; wrd &= wrd - 1)
+				ids.push_back(j + sdsl::bits::lo(wrd));
+		}
+
+		uint64_t delta_len = gamma_length(ids.size() + 1), prev = -1;
+		for (auto id : ids) {
+			delta_len += gamma_length(id - prev);
+			prev = id;
+		}
+		uint64_t rle_len = 0;
+		for_each_run(ids, num_samples, [&rle_len](uint64_t len) {
+								 rle_len += gamma_length(len); });
+
+		m_offsets[i] = pos;
+		if (num_samples <= delta_len && num_samples <= rle_len) {
+			for (uint64_t j = 0; j < num_samples; j += 64) {
+				uint64_t len = std::min((uint64_t)64, num_samples - j);
+				m_data.set_int(pos + j, rows.get_int(start + j, len), len);
+			}
+			pos += num_samples;
+		} else if (delta_len <= rle_len) {
+			m_encodings[i] = DELTA;
+			put_gamma(pos, ids.size() + 1);
+			prev = -1;
+			for (auto id : ids) {
+				put_gamma(pos, id - prev);
+				prev = id;
+			}
+		} else {
+			m_encodings[i] = RUN_LENGTH;
+			for_each_run(ids, num_samples, [this, &pos](uint64_t len) {
+									 put_gamma(pos, len); });
+		}
+	}
+	m_offsets[num_classes] = pos;
+	// Keep a word of padding so that decoding can always read 64 bits.
+	m_data.resize(pos + 64);
+}
+
+uint64_t HybridColorClasses::count(encoding e) const {
+	uint64_t cnt = 0;
+	for (uint64_t i = 0; i < size(); i++)
+		if (get_encoding(i) == e)
+			cnt++;
+	return cnt;
+}
+
+void HybridColorClasses::get_words(uint64_t i, uint64_t *words) const {
+	uint64_t num_words = (m_num_samples + 63) / 64;
+	if (get_encoding(i) == DENSE) {
+		uint64_t pos = m_offsets[i];
+		for (uint64_t w = 0; w < num_words; w++)
+			words[w] = m_data.get_int(pos + w * 64, std::min((uint64_t)64,
+																											m_num_samples - w * 64));
+		return;
+	}
+	std::fill(words, words + num_words, 0);
+	for_each_sample(i, [words](uint64_t id) {
+									words[id / 64] |= 1ULL << (id % 64); });
+}
+
+void HybridColorClasses::put_gamma(uint64_t& pos, uint64_t x) {
+	// n 0s and a 1 followed by the n low bits of x.
+	uint64_t n = sdsl::bits::hi(x);
+	m_data.set_int(pos, 1ULL << n, n + 1);
+	pos += n + 1;
+	if (n)
+		m_data.set_int(pos, x ^ (1ULL << n), n);
+	pos += n;
+}
+
+uint64_t HybridColorClasses::serialize(std::ostream& out,
+																			 sdsl::structure_tree_node* v,
+																			 std::string name) const {
+	sdsl::structure_tree_node* child = sdsl::structure_tree::add_child(v, name,
+																	 sdsl::util::class_name(*this));
+	uint64_t written_bytes = 0;
+	written_bytes += sdsl::write_member(m_num_samples, out, child,
+																			"num_samples");
+	written_bytes += m_encodings.serialize(out, child, "encodings");
+	written_bytes += m_offsets.serialize(out, child, "offsets");
+	written_bytes += m_data.serialize(out, child, "data");
+	sdsl::structure_tree::add_size(child, written_bytes);
+	return written_bytes;
+}
+
+void HybridColorClasses::load(std::istream& in) {
+	sdsl::read_member(m_num_samples, in);
+	m_encodings.load(in);
+	m_offsets.load(in);
+	m_data.load(in);
+}
@@ -22,6 +22,7 @@
 #include <fstream>
 
 #include <time.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdlib.h>
@@ -44,77 +45,58 @@
 #include "mantis_utils.hpp"
 #include "mantisconfig.hpp"
 
+typedef ColoredDbg<SampleObject<CQF<KeyObject>*>, KeyObject> cdbg_t;
+
 /*
  * ===  FUNCTION  =============================================================
- *         Name:  main
- *  Description:  
+ *         Name:  choose_num_bv_buffer
+ *  Description:  The number of color classes per buffer for an index over
+ *                num_samples experiments. The build holds up to three
+ *                num_bv_buffer * num_samples bit buffers: the one being
+ *                filled, the full one being written, and its compressed
+ *                form. They are kept within budget bytes if it is set, and
+ *                the build stops if budget can't hold three of the smallest.
  * ============================================================================
  */
-	int
-build_main ( BuildOpts& opt )
+static uint64_t choose_num_bv_buffer(uint64_t budget, uint64_t num_samples,
+																		 spdlog::logger* console)
 {
-	spdlog::logger* console = opt.console.get();
-	std::ifstream infile(opt.inlist);
-  uint64_t num_samples{0};
-  if (infile.is_open()) {
-    std::string line;
-    while (std::getline(infile, line)) { ++num_samples; }
-    infile.clear();
-    infile.seekg(0, std::ios::beg);
-    console->info("Will build mantis index over {} input experiments.", num_samples);
-  } else {
-    console->error("Input file {} does not exist or could not be opened.", opt.inlist);
-    std::exit(1);
-  }
-
-  /** try and create the output directory
-   *  and write a file to it.  Complain to the user
-   *  and exit if we cannot.
-   **/
-	std::string prefix(opt.out);
-	if (prefix.back() != '/') {
-		prefix += '/';
-	}
-	// make the output directory if it doesn't exist
-	if (!mantis::fs::DirExists(prefix.c_str())) {
-		mantis::fs::MakeDir(prefix.c_str());
-	}
-	// check to see if the output dir exists now
-	if (!mantis::fs::DirExists(prefix.c_str())) {
-		console->error("Output dir {} could not be successfully created.", prefix);
-		exit(1);
+	// Smaller buffers mean more color class files and MST buckets.
+	const uint64_t min_num_bv_buffer = 1ULL << 20;
+	uint64_t num_bv_buffer = mantis::NUM_BV_BUFFER;
+	if (budget > 0 && num_samples > 0) {
+		num_bv_buffer = std::min(num_bv_buffer, budget * 8 / (3 * num_samples));
+		if (num_bv_buffer < min_num_bv_buffer) {
+			console->error("Three color class buffers of {} color classes of {} experiments need {} MB, more than the budget of {} MB. Use a larger -m or -l.",
+										 min_num_bv_buffer, num_samples, 3 * min_num_bv_buffer *
+										 num_samples / 8 >> 20, budget >> 20);
+			exit(1);
+		}
 	}
+	console->info("Color class buffers hold {} color classes ({} MB each).",
+								num_bv_buffer, num_bv_buffer * num_samples / 8 / (1ULL << 20));
+	return num_bv_buffer;
+}
 
-  // If we made it this far, record relevant meta information in the output directory
-  nlohmann::json minfo;
-  {
-    std::ofstream jfile(prefix + "/" + mantis::meta_file_name);
-    if (jfile.is_open()) {
-      minfo = opt.to_json();
-      minfo["start_time"] = mantis::get_current_time_as_string();
-      minfo["mantis_version"] = mantis::version;
-      minfo["index_version"] = mantis::index_version;
-      jfile << minfo.dump(4);
-    } else {
-      console->error("Could not write to output directory {}", prefix);
-      exit(1);
-    }
-    jfile.close();
-  }
-
-	std::vector<SampleObject<CQF<KeyObject>*>> inobjects;
-  std::vector<CQF<KeyObject>> cqfs;
-
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  open_squeakr_files
+ *  Description:  mmaps the Squeakr files in squeakr_files and gives them the
+ *                ids 0, 1, ... in that order.
+ * ============================================================================
+ */
+static void open_squeakr_files(const std::vector<std::string>& squeakr_files,
+															 std::vector<CQF<KeyObject>>& cqfs,
+															 std::vector<SampleObject<CQF<KeyObject>*>>&
+															 inobjects, uint32_t& kmer_size,
+															 spdlog::logger* console)
+{
 	// reserve QF structs for input CQFs
-  inobjects.reserve(num_samples);
-  cqfs.reserve(num_samples);
+	inobjects.reserve(squeakr_files.size());
+	cqfs.reserve(squeakr_files.size());
 
-	// mmap all the input cqfs
-	std::string squeakr_file;
 	uint32_t nqf = 0;
-	uint32_t kmer_size{0};
-	console->info("Reading input Squeakr files.");
-	while (infile >> squeakr_file) {
+	for (std::string squeakr_file : squeakr_files) {
 		if (!mantis::fs::FileExists(squeakr_file.c_str())) {
 			console->error("Squeakr file {} does not exist.", squeakr_file);
 			exit(1);
@@ -130,7 +112,7 @@ build_main ( BuildOpts& opt )
 			console->error("Can't read Squeakr file. It was written on a different endian machine.");
 			exit(1);
 		}
-		if (cqfs.size() == 0)
+		if (kmer_size == 0)
 			kmer_size = config.kmer_size;
 		else {
 			if (kmer_size != config.kmer_size) {
@@ -143,32 +125,171 @@ build_main ( BuildOpts& opt )
 			console->warn("Squeakr file {} is not filtered.", squeakr_file);
 		}
 
-    cqfs.emplace_back(squeakr_file, CQF_MMAP);
+		cqfs.emplace_back(squeakr_file, CQF_MMAP);
 		//std::string sample_id = first_part(first_part(last_part(squeakr_file, '/'),
 																									//'.'), '_');
 		std::string sample_id = squeakr_file;
 		console->info("Reading CQF {} Seed {}",nqf, cqfs[nqf].seed());
 		console->info("Sample id {}", sample_id);
 		cqfs.back().dump_metadata();
-    inobjects.emplace_back(&cqfs[nqf], sample_id, nqf);
+		inobjects.emplace_back(&cqfs[nqf], sample_id, nqf);
 		if (!cqfs.front().check_similarity(&cqfs.back())) {
 			console->error("Passed Squeakr files are not similar.", squeakr_file);
 			exit(1);
 		}
-    nqf++;
+		nqf++;
 	}
+}
 
-	ColoredDbg<SampleObject<CQF<KeyObject>*>, KeyObject> cdbg(opt.qbits,
-																														inobjects[0].obj->keybits(),
-																														cqfs[0].hash_mode(),
-																														inobjects[0].obj->seed(),
-																														prefix, nqf, MANTIS_DBG_ON_DISK);
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  load_eqclasses
+ *  Description:  Reads the color class files of the index in prefix in id
+ *                order.
+ * ============================================================================
+ */
+static std::vector<HybridColorClasses> load_eqclasses(const std::string&
+																											prefix)
+{
+	std::vector<std::string> eqclass_files =
+		mantis::fs::GetFilesExt(prefix.c_str(), mantis::EQCLASS_FILE);
+	std::map<int, std::string> sorted_files;
+	for (std::string file : eqclass_files) {
+		int id = std::stoi(first_part(last_part(file, '/'), '_'));
+		sorted_files[id] = file;
+	}
+	std::vector<HybridColorClasses> eqclasses(sorted_files.size());
+	uint32_t i = 0;
+	for (auto file : sorted_files)
+		sdsl::load_from_file(eqclasses[i++], file.second);
+	return eqclasses;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  open_index
+ *  Description:  mmaps the colored dbg of the index in prefix and reads its
+ *                color classes and the names of its samples in id order.
+ * ============================================================================
+ */
+static void open_index(const std::string& prefix, std::vector<CQF<KeyObject>>&
+											 cqfs, InputColorClasses& colors,
+											 std::vector<std::string>& sample_names,
+											 spdlog::logger* console)
+{
+	std::string dbg_file(prefix + mantis::CQF_FILE);
+	if (!mantis::fs::FileExists(dbg_file.c_str())) {
+		console->error("Colored dbg file {} does not exist.", dbg_file);
+		exit(1);
+	}
+	check_index_version(prefix, console);
+	colors.eqclasses = load_eqclasses(prefix);
+	colors.num_bv_buffer = read_num_bv_buffer(prefix);
+	if (colors.eqclasses.empty()) {
+		console->error("No color classes found in {}. The color classes are needed to merge the index.",
+									 prefix);
+		exit(1);
+	}
+
+	std::map<uint32_t, std::string> samples;
+	std::ifstream sampleid(prefix + mantis::SAMPLEID_FILE);
+	std::string sample;
+	uint32_t id;
+	while (sampleid >> id >> sample)
+		samples[id] = sample;
+	sampleid.close();
+	if (samples.size() != colors.eqclasses.front().num_samples() ||
+			samples.rbegin()->first != samples.size() - 1) {
+		console->error("The sample ids in {} do not match the color classes.",
+									 prefix + mantis::SAMPLEID_FILE);
+		exit(1);
+	}
+	for (auto& it : samples)
+		sample_names.push_back(it.second);
+
+	cqfs.emplace_back(dbg_file, CQF_MMAP);
+	console->info("Read index {} with {} experiments and {} k-mers", prefix,
+								sample_names.size(), cqfs.back().dist_elts());
+}
+
+/* Whether the paths a and b name the same existing directory. */
+static bool same_dir(const std::string& a, const std::string& b)
+{
+	char a_path[PATH_MAX], b_path[PATH_MAX];
+	return realpath(a.c_str(), a_path) && realpath(b.c_str(), b_path) &&
+		std::string(a_path) == b_path;
+}
+
+/* The smallest log of the number of slots of a CQF that holds num_slots
+ * slots at a load factor of at most load. */
+static uint64_t qbits_for(uint64_t num_slots, double load)
+{
+	uint64_t qbits = 6;
+	while ((1ULL << qbits) * load < num_slots)
+		qbits++;
+	return qbits;
+}
+
+/* Bytes of an output CQF with 2^qbits slots for inputs like in and of the
+ * color class buffers of num_samples experiments. */
+static uint64_t build_bytes(uint64_t qbits, const CQF<KeyObject>& in,
+														uint64_t num_bv_buffer, uint64_t num_samples)
+{
+	QF qf;
+	return qf_init(&qf, 1ULL << qbits, in.keybits(), 0, in.hash_mode(),
+								 in.seed(), NULL, 0) + 3 * num_bv_buffer * num_samples / 8;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  build_cdbg
+ *  Description:  Merges inobjects into a colored dbg and writes it to prefix.
+ *                samples are the experiments of the index. They are the same
+ *                as inobjects unless the inputs are colored dbgs, in which
+ *                case input_colors holds their color classes.
+ * ============================================================================
+ */
+static void build_cdbg(BuildOpts& opt,
+											 std::vector<SampleObject<CQF<KeyObject>*>>& inobjects,
+											 std::vector<SampleObject<CQF<KeyObject>*>>& samples,
+											 const std::vector<InputColorClasses>* input_colors,
+											 std::string prefix, bool flush_eqclass_dist)
+{
+	spdlog::logger* console = opt.console.get();
+	// Without -s, start with a CQF that holds the biggest input. The sampling
+	// phase then tells how big the whole dbg gets.
+	uint64_t qbits = opt.qbits;
+	if (qbits == 0) {
+		uint64_t max_kmers = 0;
+		for (auto& in : inobjects)
+			max_kmers = std::max(max_kmers, in.obj->dist_elts());
+		qbits = qbits_for(max_kmers, 0.95);
+	}
+	if (opt.mem_limit > 0) {
+		// The output CQF and the color class buffers are allocated up front.
+		// Don't start a build that can not fit them.
+		uint64_t needed = build_bytes(qbits, *inobjects[0].obj,
+																	opt.num_bv_buffer, samples.size());
+		if (needed > opt.mem_limit << 30) {
+			console->error("The output CQF and the color class buffers need {} MB, more than the limit of {} GB. Use a smaller -s or -m.",
+										 needed >> 20, opt.mem_limit);
+			exit(1);
+		}
+	}
+	cdbg_t cdbg(qbits, inobjects[0].obj->keybits(),
+							inobjects[0].obj->hash_mode(), inobjects[0].obj->seed(), prefix,
+							samples.size(), MANTIS_DBG_ON_DISK, opt.num_bv_buffer);
 	cdbg.set_console(console);
-	if (opt.flush_eqclass_dist) {
+	cdbg.set_num_threads(opt.numthreads);
+	if (opt.mem_limit > 0)
+		cdbg.set_mem_limit(opt.mem_limit << 30);
+	if (input_colors)
+		cdbg.set_input_colors(input_colors);
+	if (flush_eqclass_dist) {
 		cdbg.set_flush_eqclass_dist();
-  }
+	}
 
-	cdbg.build_sampleid_map(inobjects.data());
+	cdbg.build_sampleid_map(samples.data());
 
 	console->info("Sampling eq classes based on {} kmers", mantis::SAMPLE_SIZE);
 	// First construct the colored dbg on initial SAMPLE_SIZE k-mers.
@@ -179,6 +300,40 @@ build_main ( BuildOpts& opt )
 	console->info("Number of eq classes found after sampling {}",
 								unsorted_map.size());
 
+	// The sampled k-mers are the ones in the first part of the hash space and
+	// the hashes are uniform, so scaling them up predicts the size of the
+	// whole dbg. Allocate that much now instead of resizing during the merge,
+	// with some slack for the eq class ids that are not found yet.
+	double fraction = cdbg.merged_fraction();
+	uint64_t est_kmers = cdbg.get_cqf()->dist_elts() / fraction;
+	uint64_t est_slots = cdbg.get_cqf()->occupied_slots() / fraction;
+	qbits = std::max(qbits_for(est_slots, 0.8),
+									 (uint64_t)sdsl::bits::hi(cdbg.get_cqf()->numslots()));
+	console->info("The sampled {:.2f}% of the hash space predicts {} k-mers in {} slots. Using a CQF with 2^{} slots.",
+								fraction * 100, est_kmers, est_slots, qbits);
+	if (opt.mem_limit > 0) {
+		// The CQF can not shrink, so keep at least the slots it has now and
+		// let it resize itself if the rest of the merge needs more.
+		uint64_t min_qbits = sdsl::bits::hi(cdbg.get_cqf()->numslots());
+		uint64_t max_qbits = qbits;
+		while (max_qbits > min_qbits &&
+					 build_bytes(max_qbits, *inobjects[0].obj, opt.num_bv_buffer,
+											 samples.size()) > opt.mem_limit << 30)
+			max_qbits--;
+		uint64_t needed = build_bytes(max_qbits, *inobjects[0].obj,
+																	opt.num_bv_buffer, samples.size());
+		if (needed > opt.mem_limit << 30) {
+			console->error("The output CQF and the color class buffers need {} MB, more than the limit of {} GB. Use a smaller -s or -m.",
+										 needed >> 20, opt.mem_limit);
+			exit(1);
+		}
+		if (max_qbits < qbits) {
+			console->warn("A CQF with 2^{} slots does not fit in the limit of {} GB. Using 2^{} slots.",
+										qbits, opt.mem_limit, max_qbits);
+			qbits = max_qbits;
+		}
+	}
+
 	// Sort equivalence classes based on their abundances.
 	std::multimap<uint64_t, __uint128_t, std::greater<uint64_t>> sorted;
 	for (auto& it : unsorted_map) {
@@ -192,22 +347,34 @@ build_main ( BuildOpts& opt )
 	uint64_t i = 1;
 	for (auto& it : sorted) {
 		//DEBUG_CDBG(it.first << " " << it.second.data());
-		std::pair<uint64_t, uint64_t> val(i, 0);
+		// The k-mers seen while sampling are not merged again with no_restart so
+		// their abundance is kept.
+		std::pair<uint64_t, uint64_t> val(i, opt.no_restart ? it.first : 0);
 		std::pair<__uint128_t, std::pair<uint64_t, uint64_t>> keyval(it.second, val);
 		sorted_map.insert(keyval);
 		i++;
 	}
 
-	console->info("Reinitializing colored DBG after the sampling phase.");
-	cdbg.reinit(sorted_map);
+	if (opt.no_restart) {
+		console->info("Remapping eq class ids after the sampling phase.");
+		cdbg.remap(sorted_map, qbits);
+	} else {
+		console->info("Reinitializing colored DBG after the sampling phase.");
+		cdbg.reinit(sorted_map, qbits);
+	}
 
 	console->info("Constructing the colored dBG.");
 
 	// Reconstruct the colored dbg using the new set of equivalence classes.
+	// With no_restart this continues after the k-mers merged while sampling.
 	cdbg.construct(inobjects.data(), std::numeric_limits<uint64_t>::max());
 
 	console->info("Final colored dBG has {} k-mers and {} equivalence classes",
 								cdbg.get_cqf()->dist_elts(), cdbg.get_num_eqclasses());
+	console->info("Predicted {} k-mers in {} slots, got {} k-mers in {} slots of 2^{}.",
+								est_kmers, est_slots, cdbg.get_cqf()->dist_elts(),
+								cdbg.get_cqf()->occupied_slots(),
+								sdsl::bits::hi(cdbg.get_cqf()->numslots()));
 
 	//cdbg.get_cqf()->dump_metadata();
 	//DEBUG_CDBG(cdbg.get_cqf()->set_size());
@@ -215,6 +382,150 @@ build_main ( BuildOpts& opt )
 	console->info("Serializing CQF and eq classes in {}", prefix);
 	cdbg.serialize();
 	console->info("Serialization done.");
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  main
+ *  Description:  
+ * ============================================================================
+ */
+	int
+build_main ( BuildOpts& opt )
+{
+	spdlog::logger* console = opt.console.get();
+	std::ifstream infile(opt.inlist);
+  uint64_t num_samples{0};
+  if (infile.is_open()) {
+    std::string line;
+    while (std::getline(infile, line)) { ++num_samples; }
+    infile.clear();
+    infile.seekg(0, std::ios::beg);
+    console->info("Will build mantis index over {} input experiments.", num_samples);
+  } else {
+    console->error("Input file {} does not exist or could not be opened.", opt.inlist);
+    std::exit(1);
+  }
+
+  /** try and create the output directory
+   *  and write a file to it.  Complain to the user
+   *  and exit if we cannot.
+   **/
+	std::string prefix(opt.out);
+	if (prefix.back() != '/') {
+		prefix += '/';
+	}
+	// make the output directory if it doesn't exist
+	if (!mantis::fs::DirExists(prefix.c_str())) {
+		mantis::fs::MakeDir(prefix.c_str());
+	}
+	// check to see if the output dir exists now
+	if (!mantis::fs::DirExists(prefix.c_str())) {
+		console->error("Output dir {} could not be successfully created.", prefix);
+		exit(1);
+	}
+
+	// With a limit on the whole build, the color class buffers get at most
+	// half of it.
+	uint64_t bv_budget = opt.max_memory << 30;
+	if (opt.mem_limit > 0 && (bv_budget == 0 || bv_budget > opt.mem_limit << 29))
+		bv_budget = opt.mem_limit << 29;
+	opt.num_bv_buffer = choose_num_bv_buffer(bv_budget, num_samples, console);
+
+  // If we made it this far, record relevant meta information in the output directory
+  nlohmann::json minfo;
+  {
+    std::ofstream jfile(prefix + "/" + mantis::meta_file_name);
+    if (jfile.is_open()) {
+      minfo = opt.to_json();
+      minfo["start_time"] = mantis::get_current_time_as_string();
+      minfo["mantis_version"] = mantis::version;
+      minfo["index_version"] = mantis::index_version;
+      jfile << minfo.dump(4);
+    } else {
+      console->error("Could not write to output directory {}", prefix);
+      exit(1);
+    }
+    jfile.close();
+  }
+
+	std::vector<std::string> squeakr_files;
+	std::string squeakr_file;
+	while (infile >> squeakr_file)
+		squeakr_files.push_back(squeakr_file);
+	uint32_t kmer_size{0};
+
+	uint32_t group_size = opt.group_size;
+	if (group_size == 0 || group_size >= squeakr_files.size()) {
+		// mmap all the input cqfs
+		std::vector<SampleObject<CQF<KeyObject>*>> inobjects;
+		std::vector<CQF<KeyObject>> cqfs;
+		console->info("Reading input Squeakr files.");
+		open_squeakr_files(squeakr_files, cqfs, inobjects, kmer_size, console);
+		build_cdbg(opt, inobjects, inobjects, nullptr, prefix,
+							 opt.flush_eqclass_dist);
+	} else {
+		// Level 1: build an intermediate index over each group of inputs so that
+		// at most group_size Squeakr files are open at a time.
+		uint32_t num_groups = (squeakr_files.size() + group_size - 1) /
+			group_size;
+		console->info("Building the index in two levels over {} groups of up to {} input experiments.",
+									num_groups, group_size);
+		std::vector<std::string> group_prefixes;
+		for (uint32_t g = 0; g < num_groups; g++) {
+			std::vector<std::string> group_files(squeakr_files.begin() + g *
+																					 group_size, squeakr_files.begin() +
+																					 std::min((size_t)(g + 1) *
+																										group_size,
+																										squeakr_files.size()));
+			std::string group_prefix(prefix + "level1_" + std::to_string(g) + "/");
+			if (!mantis::fs::DirExists(group_prefix.c_str()))
+				mantis::fs::MakeDir(group_prefix.c_str());
+			group_prefixes.push_back(group_prefix);
+
+			console->info("Building intermediate index {} of {} in {}", g + 1,
+										num_groups, group_prefix);
+			std::vector<SampleObject<CQF<KeyObject>*>> inobjects;
+			std::vector<CQF<KeyObject>> cqfs;
+			open_squeakr_files(group_files, cqfs, inobjects, kmer_size, console);
+			build_cdbg(opt, inobjects, inobjects, nullptr, group_prefix, false);
+			for (auto& cqf : cqfs)
+				cqf.close();
+		}
+
+		// Level 2: merge the intermediate indexes. A k-mer's eq class id in an
+		// intermediate index is mapped to the samples of its group.
+		console->info("Merging the {} intermediate indexes.", num_groups);
+		std::vector<CQF<KeyObject>> group_cqfs;
+		std::vector<InputColorClasses> input_colors(num_groups);
+		std::vector<SampleObject<CQF<KeyObject>*>> inobjects;
+		group_cqfs.reserve(num_groups);
+		for (uint32_t g = 0; g < num_groups; g++) {
+			std::string dbg_file(group_prefixes[g] + mantis::CQF_FILE);
+			group_cqfs.emplace_back(dbg_file, CQF_MMAP);
+			input_colors[g].eqclasses = load_eqclasses(group_prefixes[g]);
+			input_colors[g].num_bv_buffer = opt.num_bv_buffer;
+			input_colors[g].first_sample = g * group_size;
+			inobjects.emplace_back(&group_cqfs[g], group_prefixes[g], g);
+		}
+		std::vector<SampleObject<CQF<KeyObject>*>> samples;
+		for (uint32_t i = 0; i < squeakr_files.size(); i++)
+			samples.emplace_back(nullptr, squeakr_files[i], i);
+		build_cdbg(opt, inobjects, samples, &input_colors, prefix,
+							 opt.flush_eqclass_dist);
+
+		for (auto& cqf : group_cqfs)
+			cqf.close();
+		for (auto& group_prefix : group_prefixes) {
+			std::vector<std::string> files =
+				mantis::fs::GetFilesExt(group_prefix.c_str(), mantis::EQCLASS_FILE);
+			files.push_back(group_prefix + mantis::CQF_FILE);
+			files.push_back(group_prefix + mantis::SAMPLEID_FILE);
+			for (auto& file : files)
+				std::remove(file.c_str());
+			rmdir(group_prefix.c_str());
+		}
+	}
 
   {
     std::ofstream jfile(prefix + "/" + mantis::meta_file_name);
@@ -229,3 +540,264 @@ build_main ( BuildOpts& opt )
 
   return EXIT_SUCCESS;
 }				/* ----------  end of function main  ---------- */
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  add_main
+ *  Description:  Writes a new index with the experiments of an existing
+ *                index and the Squeakr files in the input list. The existing
+ *                index is merged as a colored dbg, so its samples are not
+ *                read again.
+ * ============================================================================
+ */
+	int
+add_main ( AddOpts& opt )
+{
+	spdlog::logger* console = opt.console.get();
+	std::string index_prefix(opt.prefix);
+	if (index_prefix.back() != '/') {
+		index_prefix += '/';
+	}
+	std::string prefix(opt.out);
+	if (prefix.back() != '/') {
+		prefix += '/';
+	}
+	if (same_dir(prefix, index_prefix)) {
+		console->error("The new index must be written to a different directory than {}",
+									 index_prefix);
+		exit(1);
+	}
+	if (mantis::fs::FileExists((index_prefix + mantis::PARENTBV_FILE).c_str()))
+		console->warn("The MST of {} is not carried over. Run mantis mst on the new index.",
+									index_prefix);
+
+	std::ifstream infile(opt.inlist);
+	if (!infile.is_open()) {
+		console->error("Input file {} does not exist or could not be opened.", opt.inlist);
+		exit(1);
+	}
+	std::vector<std::string> squeakr_files;
+	std::string squeakr_file;
+	while (infile >> squeakr_file)
+		squeakr_files.push_back(squeakr_file);
+	if (squeakr_files.empty()) {
+		console->error("No input experiments in {}", opt.inlist);
+		exit(1);
+	}
+
+	// The existing index is input 0 and keeps its sample ids. The new
+	// experiments are inputs 1, 2, ... and get the sample ids after it.
+	std::vector<CQF<KeyObject>> index_cqfs;
+	std::vector<InputColorClasses> input_colors(1);
+	std::vector<std::string> sample_names;
+	open_index(index_prefix, index_cqfs, input_colors[0], sample_names,
+						 console);
+	uint32_t num_old_samples = sample_names.size();
+
+	std::vector<CQF<KeyObject>> cqfs;
+	std::vector<SampleObject<CQF<KeyObject>*>> new_objects;
+	uint32_t kmer_size{0};
+	console->info("Reading {} new Squeakr files.", squeakr_files.size());
+	open_squeakr_files(squeakr_files, cqfs, new_objects, kmer_size, console);
+	if (!index_cqfs[0].check_similarity(&cqfs[0])) {
+		console->error("The Squeakr files do not have the k-mer size, hash mode and seed of the index.");
+		exit(1);
+	}
+
+	std::set<std::string> old_names(sample_names.begin(), sample_names.end());
+	std::vector<SampleObject<CQF<KeyObject>*>> inobjects;
+	inobjects.emplace_back(&index_cqfs[0], index_prefix, 0);
+	for (uint32_t i = 0; i < squeakr_files.size(); i++) {
+		if (!old_names.insert(squeakr_files[i]).second) {
+			console->error("Experiment {} is already in the index.", squeakr_files[i]);
+			exit(1);
+		}
+		inobjects.emplace_back(&cqfs[i], squeakr_files[i], i + 1);
+		input_colors.emplace_back();
+		input_colors.back().first_sample = num_old_samples + i;
+		sample_names.push_back(squeakr_files[i]);
+	}
+	std::vector<SampleObject<CQF<KeyObject>*>> samples;
+	for (uint32_t i = 0; i < sample_names.size(); i++)
+		samples.emplace_back(nullptr, sample_names[i], i);
+	console->info("Adding {} experiments to the {} in {}", squeakr_files.size(),
+								num_old_samples, index_prefix);
+
+	uint64_t num_bv_buffer = choose_num_bv_buffer(opt.max_memory << 30,
+																								 samples.size(), console);
+
+	if (!mantis::fs::DirExists(prefix.c_str())) {
+		mantis::fs::MakeDir(prefix.c_str());
+	}
+	if (!mantis::fs::DirExists(prefix.c_str())) {
+		console->error("Output dir {} could not be successfully created.", prefix);
+		exit(1);
+	}
+
+	nlohmann::json minfo;
+	{
+		std::ofstream jfile(prefix + mantis::meta_file_name);
+		if (jfile.is_open()) {
+			minfo = opt.to_json();
+			minfo[mantis::NUM_BV_BUFFER_KEY] = num_bv_buffer;
+			minfo["start_time"] = mantis::get_current_time_as_string();
+			minfo["mantis_version"] = mantis::version;
+			minfo["index_version"] = mantis::index_version;
+			jfile << minfo.dump(4);
+		} else {
+			console->error("Could not write to output directory {}", prefix);
+			exit(1);
+		}
+		jfile.close();
+	}
+
+	// Start from the size of the existing CQF. It grows if the new k-mers do
+	// not fit.
+	BuildOpts bopt;
+	bopt.qbits = sdsl::bits::hi(index_cqfs[0].numslots());
+	bopt.numthreads = opt.numthreads;
+	bopt.no_restart = opt.no_restart;
+	bopt.num_bv_buffer = num_bv_buffer;
+	bopt.console = opt.console;
+	build_cdbg(bopt, inobjects, samples, &input_colors, prefix, false);
+
+	index_cqfs[0].close();
+	for (auto& cqf : cqfs)
+		cqf.close();
+
+	{
+		std::ofstream jfile(prefix + mantis::meta_file_name);
+		if (jfile.is_open()) {
+			minfo["end_time"] = mantis::get_current_time_as_string();
+			jfile << minfo.dump(4);
+		} else {
+			console->error("Could not write to output directory {}", prefix);
+		}
+		jfile.close();
+	}
+
+	return EXIT_SUCCESS;
+}				/* ----------  end of function add_main  ---------- */
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  merge_main
+ *  Description:  Merges two indexes over disjoint sets of experiments into
+ *                one. Both colored dbgs are walked in hash order and the
+ *                color class of a k-mer is the union of its classes in the
+ *                two indexes, with the experiments of the second index
+ *                numbered after those of the first.
+ * ============================================================================
+ */
+	int
+merge_main ( MergeOpts& opt )
+{
+	spdlog::logger* console = opt.console.get();
+	std::vector<std::string> index_prefixes{opt.first_prefix,
+		opt.second_prefix};
+	for (auto& index_prefix : index_prefixes)
+		if (index_prefix.back() != '/')
+			index_prefix += '/';
+	std::string prefix(opt.out);
+	if (prefix.back() != '/') {
+		prefix += '/';
+	}
+	if (same_dir(index_prefixes[0], index_prefixes[1])) {
+		console->error("Can't merge index {} with itself.", index_prefixes[0]);
+		exit(1);
+	}
+	for (auto& index_prefix : index_prefixes) {
+		if (same_dir(prefix, index_prefix)) {
+			console->error("The merged index must be written to a different directory than {}",
+										 index_prefix);
+			exit(1);
+		}
+	}
+
+	std::vector<CQF<KeyObject>> index_cqfs;
+	std::vector<InputColorClasses> input_colors(2);
+	std::vector<std::string> sample_names;
+	index_cqfs.reserve(2);
+	for (uint32_t i = 0; i < 2; i++) {
+		input_colors[i].first_sample = sample_names.size();
+		open_index(index_prefixes[i], index_cqfs, input_colors[i], sample_names,
+							 console);
+	}
+	if (!index_cqfs[0].check_similarity(&index_cqfs[1])) {
+		console->error("The indexes do not have the same k-mer size, hash mode and seed.");
+		exit(1);
+	}
+	std::set<std::string> names;
+	for (auto& name : sample_names) {
+		if (!names.insert(name).second) {
+			console->error("Experiment {} is in both indexes.", name);
+			exit(1);
+		}
+	}
+
+	uint64_t num_bv_buffer = choose_num_bv_buffer(opt.max_memory << 30,
+																								 sample_names.size(), console);
+
+	if (!mantis::fs::DirExists(prefix.c_str())) {
+		mantis::fs::MakeDir(prefix.c_str());
+	}
+	if (!mantis::fs::DirExists(prefix.c_str())) {
+		console->error("Output dir {} could not be successfully created.", prefix);
+		exit(1);
+	}
+
+	nlohmann::json minfo;
+	{
+		std::ofstream jfile(prefix + mantis::meta_file_name);
+		if (jfile.is_open()) {
+			minfo = opt.to_json();
+			minfo[mantis::NUM_BV_BUFFER_KEY] = num_bv_buffer;
+			minfo["start_time"] = mantis::get_current_time_as_string();
+			minfo["mantis_version"] = mantis::version;
+			minfo["index_version"] = mantis::index_version;
+			jfile << minfo.dump(4);
+		} else {
+			console->error("Could not write to output directory {}", prefix);
+			exit(1);
+		}
+		jfile.close();
+	}
+
+	std::vector<SampleObject<CQF<KeyObject>*>> inobjects;
+	for (uint32_t i = 0; i < 2; i++)
+		inobjects.emplace_back(&index_cqfs[i], index_prefixes[i], i);
+	std::vector<SampleObject<CQF<KeyObject>*>> samples;
+	for (uint32_t i = 0; i < sample_names.size(); i++)
+		samples.emplace_back(nullptr, sample_names[i], i);
+	console->info("Merging the {} experiments of {} with the {} of {}",
+								input_colors[1].first_sample, index_prefixes[0],
+								sample_names.size() - input_colors[1].first_sample,
+								index_prefixes[1]);
+
+	// Start from the size of the bigger CQF. It grows if the union does not
+	// fit.
+	BuildOpts bopt;
+	bopt.qbits = sdsl::bits::hi(std::max(index_cqfs[0].numslots(),
+																			 index_cqfs[1].numslots()));
+	bopt.numthreads = opt.numthreads;
+	bopt.no_restart = opt.no_restart;
+	bopt.num_bv_buffer = num_bv_buffer;
+	bopt.console = opt.console;
+	build_cdbg(bopt, inobjects, samples, &input_colors, prefix, false);
+
+	for (auto& cqf : index_cqfs)
+		cqf.close();
+
+	{
+		std::ofstream jfile(prefix + mantis::meta_file_name);
+		if (jfile.is_open()) {
+			minfo["end_time"] = mantis::get_current_time_as_string();
+			jfile << minfo.dump(4);
+		} else {
+			console->error("Could not write to output directory {}", prefix);
+		}
+		jfile.close();
+	}
+
+	return EXIT_SUCCESS;
+}				/* ----------  end of function merge_main  ---------- */
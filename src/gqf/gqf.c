@@ -18,6 +18,7 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #include "gqf/hashutil.h"
 #include "gqf/gqf.h"
@@ -262,13 +263,73 @@ static void modify_metadata(pc_t *metadata, int cnt)
 	return;
 }
 
+/* Picked at startup by pick_bitops. */
+static enum qf_bitops bitops = QF_BITOPS_GENERIC;
+
+static bool cpu_has_bitops(enum qf_bitops b)
+{
+	__builtin_cpu_init();
+	switch (b) {
+		case QF_BITOPS_BMI2:
+			return __builtin_cpu_supports("popcnt") &&
+				__builtin_cpu_supports("bmi") && __builtin_cpu_supports("bmi2");
+		case QF_BITOPS_POPCNT:
+			return __builtin_cpu_supports("popcnt");
+		default:
+			return true;
+	}
+}
+
+/* AMD CPUs before Zen 3 run pdep in microcode, which takes longer than the
+ * broadword select. */
+__attribute__((constructor)) static void pick_bitops(void)
+{
+	__builtin_cpu_init();
+	bool slow_pdep = __builtin_cpu_is("amdfam15h") ||
+		__builtin_cpu_is("amdfam17h");
+	if (cpu_has_bitops(QF_BITOPS_BMI2) && !slow_pdep)
+		bitops = QF_BITOPS_BMI2;
+	else if (cpu_has_bitops(QF_BITOPS_POPCNT))
+		bitops = QF_BITOPS_POPCNT;
+	else
+		bitops = QF_BITOPS_GENERIC;
+}
+
+bool qf_set_bitops(enum qf_bitops b)
+{
+	if (!cpu_has_bitops(b))
+		return false;
+	bitops = b;
+	return true;
+}
+
+enum qf_bitops qf_get_bitops(void)
+{
+	return bitops;
+}
+
+const char *qf_bitops_name(enum qf_bitops b)
+{
+	switch (b) {
+		case QF_BITOPS_BMI2: return "bmi2";
+		case QF_BITOPS_POPCNT: return "popcnt";
+		default: return "generic";
+	}
+}
+
 static inline int popcnt(uint64_t val)
 {
-	asm("popcnt %[val], %[val]"
-			: [val] "+r" (val)
-			:
-			: "cc");
-	return val;
+	if (bitops != QF_BITOPS_GENERIC) {
+		asm("popcnt %[val], %[val]"
+				: [val] "+r" (val)
+				:
+				: "cc");
+		return val;
+	}
+	val = val - ((val >> 1) & 0x5555555555555555ULL);
+	val = (val & 0x3333333333333333ULL) + ((val >> 2) & 0x3333333333333333ULL);
+	val = (val + (val >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+	return (val * 0x0101010101010101ULL) >> 56;
 }
 
 static inline int64_t bitscanreverse(uint64_t val)
@@ -295,12 +356,7 @@ static inline int popcntv(const uint64_t val, int ignore)
 // Returns the number of 1s up to (and including) the pos'th bit
 // Bits are numbered from 0
 static inline int bitrank(uint64_t val, int pos) {
-	val = val & ((2ULL << pos) - 1);
-	asm("popcnt %[val], %[val]"
-			: [val] "+r" (val)
-			:
-			: "cc");
-	return val;
+	return popcnt(val & ((2ULL << pos) - 1));
 }
 
 /**
@@ -426,17 +482,22 @@ static inline uint64_t _select64(uint64_t x, int k)
 // Returns the position of the rank'th 1.  (rank = 0 returns the 1st 1)
 // Returns 64 if there are fewer than rank+1 1s.
 static inline uint64_t bitselect(uint64_t val, int rank) {
-#ifdef __SSE4_2_
-	uint64_t i = 1ULL << rank;
-	asm("pdep %[val], %[mask], %[val]"
-			: [val] "+r" (val)
-			: [mask] "r" (i));
-	asm("tzcnt %[bit], %[index]"
-			: [index] "=r" (i)
-			: [bit] "g" (val)
-			: "cc");
-	return i;
-#endif
+	if (bitops == QF_BITOPS_BMI2) {
+		/* 1ULL << 64 is undefined (and is 1 on x86), which would make pdep
+		 * select the lowest set bit instead of reporting that there is no such
+		 * bit. */
+		if (rank >= 64)
+			return 64;
+		uint64_t i = 1ULL << rank;
+		asm("pdep %[val], %[mask], %[val]"
+				: [val] "+r" (val)
+				: [mask] "r" (i));
+		asm("tzcnt %[bit], %[index]"
+				: [index] "=r" (i)
+				: [bit] "g" (val)
+				: "cc");
+		return i;
+	}
 	return _select64(val, rank);
 }
 
@@ -548,6 +609,82 @@ static inline void set_slot(const QF *qf, uint64_t index, uint64_t value)
 
 #endif
 
+/* The read paths below take the slot width as an argument and are called
+ * through DISPATCH_SLOT_WIDTH, which passes a constant for the widths that
+ * CQFs usually have: 8, 16 and 32, and 12 to 24, which is 2k minus the log of
+ * the number of slots for the k-mers and CQF sizes of Mantis indices. The
+ * compiler then folds the block size, the slot offset, the shift and the mask.
+ * Other widths go through the same code with the width from the metadata.
+ * expr sees the width as BITS and can leave with return or break. */
+#if QF_BITS_PER_SLOT > 0
+#define DISPATCH_SLOT_WIDTH(qf, expr) \
+	do { const uint64_t BITS = QF_BITS_PER_SLOT; expr; } while (0)
+#else
+#define SLOT_WIDTH_CASE(width, expr) \
+	case width: { const uint64_t BITS = width; expr; }
+#define DISPATCH_SLOT_WIDTH(qf, expr) \
+	switch ((qf)->metadata->bits_per_slot) { \
+		SLOT_WIDTH_CASE(8, expr) \
+		SLOT_WIDTH_CASE(12, expr) \
+		SLOT_WIDTH_CASE(13, expr) \
+		SLOT_WIDTH_CASE(14, expr) \
+		SLOT_WIDTH_CASE(15, expr) \
+		SLOT_WIDTH_CASE(16, expr) \
+		SLOT_WIDTH_CASE(17, expr) \
+		SLOT_WIDTH_CASE(18, expr) \
+		SLOT_WIDTH_CASE(19, expr) \
+		SLOT_WIDTH_CASE(20, expr) \
+		SLOT_WIDTH_CASE(21, expr) \
+		SLOT_WIDTH_CASE(22, expr) \
+		SLOT_WIDTH_CASE(23, expr) \
+		SLOT_WIDTH_CASE(24, expr) \
+		SLOT_WIDTH_CASE(32, expr) \
+		default: { const uint64_t BITS = (qf)->metadata->bits_per_slot; expr; } \
+	}
+#endif
+
+static inline __attribute__((always_inline)) qfblock *
+get_block_bits(const QF *qf, uint64_t block_index, const uint64_t bits)
+{
+#if QF_BITS_PER_SLOT > 0
+	return get_block(qf, block_index);
+#else
+	return (qfblock *)(((char *)qf->blocks) + block_index * (sizeof(qfblock) +
+																													 QF_SLOTS_PER_BLOCK *
+																													 bits / 8));
+#endif
+}
+
+static inline __attribute__((always_inline)) int
+is_runend_bits(const QF *qf, uint64_t index, const uint64_t bits)
+{
+	return (get_block_bits(qf, index / QF_SLOTS_PER_BLOCK,
+												 bits)->runends[(index % QF_SLOTS_PER_BLOCK) / 64] >>
+					((index % QF_SLOTS_PER_BLOCK) % 64)) & 1ULL;
+}
+
+static inline __attribute__((always_inline)) int
+is_occupied_bits(const QF *qf, uint64_t index, const uint64_t bits)
+{
+	return (get_block_bits(qf, index / QF_SLOTS_PER_BLOCK,
+												 bits)->occupieds[(index % QF_SLOTS_PER_BLOCK) / 64] >>
+					((index % QF_SLOTS_PER_BLOCK) % 64)) & 1ULL;
+}
+
+static inline __attribute__((always_inline)) uint64_t
+get_slot_bits(const QF *qf, uint64_t index, const uint64_t bits)
+{
+	assert(index < qf->metadata->xnslots);
+#if QF_BITS_PER_SLOT > 0
+	return get_slot(qf, index);
+#else
+	uint64_t bit = (index % QF_SLOTS_PER_BLOCK) * bits;
+	uint64_t *p = (uint64_t *)&get_block_bits(qf, index / QF_SLOTS_PER_BLOCK,
+																						bits)->slots[bit / 8];
+	return (*p >> (bit % 8)) & BITMASK(bits);
+#endif
+}
+
 static inline uint64_t run_end(const QF *qf, uint64_t hash_bucket_index);
 
 static inline uint64_t block_offset(const QF *qf, uint64_t blockidx)
@@ -1093,8 +1230,9 @@ static inline uint64_t *encode_counter(QF *qf, uint64_t remainder, uint64_t
 
 /* Returns the length of the encoding. 
 REQUIRES: index points to first slot of a counter. */
-static inline uint64_t decode_counter(const QF *qf, uint64_t index, uint64_t
-																			*remainder, uint64_t *count)
+static inline __attribute__((always_inline)) uint64_t
+decode_counter_bits(const QF *qf, uint64_t index, uint64_t *remainder,
+										uint64_t *count, const uint64_t bits)
 {
 	uint64_t base;
 	uint64_t rem;
@@ -1102,16 +1240,16 @@ static inline uint64_t decode_counter(const QF *qf, uint64_t index, uint64_t
 	uint64_t digit;
 	uint64_t end;
 
-	*remainder = rem = get_slot(qf, index);
+	*remainder = rem = get_slot_bits(qf, index, bits);
 
-	if (is_runend(qf, index)) { /* Entire run is "0" */
+	if (is_runend_bits(qf, index, bits)) { /* Entire run is "0" */
 		*count = 1; 
 		return index;
 	}
 
-	digit = get_slot(qf, index + 1);
+	digit = get_slot_bits(qf, index + 1, bits);
 
-	if (is_runend(qf, index + 1)) {
+	if (is_runend_bits(qf, index + 1, bits)) {
 		*count = digit == rem ? 2 : 1;
 		return index + (digit == rem ? 1 : 0);
 	}
@@ -1121,13 +1259,13 @@ static inline uint64_t decode_counter(const QF *qf, uint64_t index, uint64_t
 		return index + (digit == rem ? 1 : 0);
 	}
 
-	if (rem > 0 && digit == 0 && get_slot(qf, index + 2) == rem) {
+	if (rem > 0 && digit == 0 && get_slot_bits(qf, index + 2, bits) == rem) {
 		*count = 3;
 		return index + 2;
 	}
 
 	if (rem == 0 && digit == 0) {
-		if (get_slot(qf, index + 2) == 0) {
+		if (get_slot_bits(qf, index + 2, bits) == 0) {
 			*count = 3;
 			return index + 2;
 		} else {
@@ -1137,10 +1275,10 @@ static inline uint64_t decode_counter(const QF *qf, uint64_t index, uint64_t
 	}
 
 	cnt = 0;
-	base = (1ULL << qf->metadata->bits_per_slot) - (rem ? 2 : 1);
+	base = (1ULL << bits) - (rem ? 2 : 1);
 
 	end = index + 1;
-	while (digit != rem && !is_runend(qf, end)) {
+	while (digit != rem && !is_runend_bits(qf, end, bits)) {
 		if (digit > rem)
 			digit--;
 		if (digit && rem)
@@ -1148,7 +1286,7 @@ static inline uint64_t decode_counter(const QF *qf, uint64_t index, uint64_t
 		cnt = cnt * base + digit;
 
 		end++;
-		digit = get_slot(qf, end);
+		digit = get_slot_bits(qf, end, bits);
 	}
 
 	if (rem) {
@@ -1156,7 +1294,7 @@ static inline uint64_t decode_counter(const QF *qf, uint64_t index, uint64_t
 		return end;
 	}
 
-	if (is_runend(qf, end) || get_slot(qf, end + 1) != 0) {
+	if (is_runend_bits(qf, end, bits) || get_slot_bits(qf, end + 1, bits) != 0) {
 		*count = 1;
 		return index;
 	}
@@ -1165,6 +1303,13 @@ static inline uint64_t decode_counter(const QF *qf, uint64_t index, uint64_t
 	return end + 1;
 }
 
+static inline uint64_t decode_counter(const QF *qf, uint64_t index, uint64_t
+																			*remainder, uint64_t *count)
+{
+	return decode_counter_bits(qf, index, remainder, count,
+														 qf->metadata->bits_per_slot);
+}
+
 /* return the next slot which corresponds to a 
  * different element 
  * */
@@ -1368,6 +1513,8 @@ static inline int insert1(QF *qf, __uint128_t hash, uint8_t runtime_lock)
 		if (operation >= 0) {
 			uint64_t empty_slot_index = find_first_empty_slot(qf, runend_index+1);
 			if (empty_slot_index >= qf->metadata->xnslots) {
+				if (GET_NO_LOCK(runtime_lock) != QF_NO_LOCK)
+					qf_unlock(qf, hash_bucket_index, /*small*/ true);
 				return QF_NO_SPACE;
 			}
 			shift_remainders(qf, insert_index, empty_slot_index);
@@ -1476,8 +1623,11 @@ static inline int insert(QF *qf, __uint128_t hash, uint64_t count, uint8_t
 																																							p, 
 																																							&new_values[67] - p, 
 																																							0);
-			if (!ret)
+			if (!ret) {
+				if (GET_NO_LOCK(runtime_lock) != QF_NO_LOCK)
+					qf_unlock(qf, hash_bucket_index, /*small*/ false);
 				return QF_NO_SPACE;
+			}
 			modify_metadata(&qf->runtimedata->pc_ndistinct_elts, 1);
 			ret_distance = runstart_index - hash_bucket_index;
 		} else { /* Non-empty bucket */
@@ -1504,8 +1654,11 @@ static inline int insert(QF *qf, __uint128_t hash, uint64_t count, uint8_t
 																																								p, 
 																																								&new_values[67] - p, 
 																																								0);
-				if (!ret)
+				if (!ret) {
+					if (GET_NO_LOCK(runtime_lock) != QF_NO_LOCK)
+						qf_unlock(qf, hash_bucket_index, /*small*/ false);
 					return QF_NO_SPACE;
+				}
 				modify_metadata(&qf->runtimedata->pc_ndistinct_elts, 1);
 				ret_distance = (current_end + 1) - hash_bucket_index;
 				/* Found a counter for this remainder.  Add in the new count. */
@@ -1518,8 +1671,11 @@ static inline int insert(QF *qf, __uint128_t hash, uint64_t count, uint8_t
 																																					p, 
 																																					&new_values[67] - p, 
 																																					current_end - runstart_index + 1);
-			if (!ret)
+			if (!ret) {
+				if (GET_NO_LOCK(runtime_lock) != QF_NO_LOCK)
+					qf_unlock(qf, hash_bucket_index, /*small*/ false);
 				return QF_NO_SPACE;
+			}
 			ret_distance = runstart_index - hash_bucket_index;
 				/* No counter for this remainder, but there are larger
 					 remainders, so we're not appending to the bucket. */
@@ -1532,8 +1688,11 @@ static inline int insert(QF *qf, __uint128_t hash, uint64_t count, uint8_t
 																																								p, 
 																																								&new_values[67] - p, 
 																																								0);
-				if (!ret)
+				if (!ret) {
+					if (GET_NO_LOCK(runtime_lock) != QF_NO_LOCK)
+						qf_unlock(qf, hash_bucket_index, /*small*/ false);
 					return QF_NO_SPACE;
+				}
 				modify_metadata(&qf->runtimedata->pc_ndistinct_elts, 1);
 			ret_distance = runstart_index - hash_bucket_index;
 			}
@@ -1550,6 +1709,81 @@ static inline int insert(QF *qf, __uint128_t hash, uint64_t count, uint8_t
 	return ret_distance;
 }
 
+/* Writes the counter for hash after the last run of the CQF. Nothing has to
+ * be shifted, so this only writes the new slots, the runend and occupied
+ * bits, and the offsets of the blocks the new slots spill into. next_index
+ * is the slot after the last run and is moved past the new counter. The
+ * counter must end before slot limit.
+ * REQUIRES: hash is bigger than the hash of every item in the CQF. */
+static inline int append_at(QF *qf, __uint128_t hash, uint64_t count,
+														uint64_t *next_index, uint64_t limit)
+{
+	uint64_t hash_remainder           = hash & BITMASK(qf->metadata->bits_per_slot);
+	uint64_t hash_bucket_index        = hash >> qf->metadata->bits_per_slot;
+	uint64_t hash_bucket_block_offset = hash_bucket_index % QF_SLOTS_PER_BLOCK;
+	uint64_t new_values[67];
+	uint64_t *p = encode_counter(qf, hash_remainder, count, &new_values[67]);
+	uint64_t total_remainders = &new_values[67] - p;
+	uint64_t start_index, i;
+
+	if (is_occupied(qf, hash_bucket_index)) {
+		/* The run of this bucket is the last one. Extend it. */
+		start_index = *next_index;
+		if (start_index + total_remainders > limit)
+			return QF_NO_SPACE;
+		METADATA_WORD(qf, runends, start_index - 1) &= ~(1ULL << (((start_index - 1)
+																															 %
+																															 QF_SLOTS_PER_BLOCK)
+																															% 64));
+	} else {
+		/* Start a new run after the end of the last one. */
+		start_index = hash_bucket_index;
+		if (*next_index > start_index)
+			start_index = *next_index;
+		if (start_index + total_remainders > limit)
+			return QF_NO_SPACE;
+		METADATA_WORD(qf, occupieds, hash_bucket_index) |= 1ULL <<
+			(hash_bucket_block_offset % 64);
+	}
+
+	for (i = 0; i < total_remainders; i++)
+		set_slot(qf, start_index + i, p[i]);
+	uint64_t end_index = start_index + total_remainders - 1;
+	METADATA_WORD(qf, runends, end_index) |= 1ULL << ((end_index %
+																										 QF_SLOTS_PER_BLOCK) % 64);
+
+	/* Every slot up to end_index now belongs to a run that starts before the
+	 * blocks after the home block. */
+	for (i = hash_bucket_index / QF_SLOTS_PER_BLOCK + 1; i <= end_index /
+			 QF_SLOTS_PER_BLOCK; i++) {
+		uint64_t offset = end_index - QF_SLOTS_PER_BLOCK * i + 1;
+		if (offset < BITMASK(8*sizeof(qf->blocks[0].offset)))
+			get_block(qf, i)->offset = offset;
+		else
+			get_block(qf, i)->offset = (uint8_t) BITMASK(8*sizeof(qf->blocks[0].offset));
+	}
+
+	modify_metadata(&qf->runtimedata->pc_ndistinct_elts, 1);
+	modify_metadata(&qf->runtimedata->pc_noccupied_slots, total_remainders);
+	modify_metadata(&qf->runtimedata->pc_nelts, count);
+
+	*next_index = end_index + 1;
+	return start_index - hash_bucket_index;
+}
+
+/* append_at for a CQF whose last run is found from its metadata. */
+static inline int append(QF *qf, __uint128_t hash, uint64_t count)
+{
+	uint64_t hash_bucket_index = hash >> qf->metadata->bits_per_slot;
+	uint64_t next_index;
+	if (is_occupied(qf, hash_bucket_index))
+		next_index = run_end(qf, hash_bucket_index) + 1;
+	else
+		next_index = hash_bucket_index == 0 ? 0 : run_end(qf, hash_bucket_index -
+																											1) + 1;
+	return append_at(qf, hash, count, &next_index, qf->metadata->xnslots);
+}
+
 inline static int _remove(QF *qf, __uint128_t hash, uint64_t count, uint8_t
 													runtime_lock)
 {
@@ -1746,23 +1980,114 @@ void *qf_destroy(QF *qf)
 	return (void*)qf->metadata;
 }
 
-bool qf_malloc(QF *qf, uint64_t nslots, uint64_t key_bits, uint64_t
-							 value_bits, enum qf_hashmode hash, uint32_t seed)
+#define HUGE_PAGE_2MB (1ULL << 21)
+#define HUGE_PAGE_1GB (1ULL << 30)
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+static bool use_huge_pages = false;
+
+void qf_set_huge_pages(bool enabled)
 {
-	uint64_t total_num_bytes = qf_init(qf, nslots, key_bits, value_bits,
-																		 hash, seed, NULL, 0);
+	use_huge_pages = enabled;
+}
+
+enum qf_pages qf_get_pages(const QF *qf)
+{
+	return qf->runtimedata->pages;
+}
+
+const char *qf_pages_name(enum qf_pages pages)
+{
+	switch (pages) {
+		case QF_PAGES_TRANSPARENT: return "transparent huge";
+		case QF_PAGES_HUGETLB_2MB: return "2 MB huge";
+		case QF_PAGES_HUGETLB_1GB: return "1 GB huge";
+		default: return "normal";
+	}
+}
+
+void qf_advise_huge_pages(qfruntime *runtime, void *addr, uint64_t len)
+{
+#ifdef MADV_HUGEPAGE
+	if (use_huge_pages && madvise(addr, len, MADV_HUGEPAGE) == 0)
+		runtime->pages = QF_PAGES_TRANSPARENT;
+#endif
+}
 
-	void *buffer = malloc(total_num_bytes);
-	if (buffer == NULL) {
+/* Map size bytes from the reserved pool of huge pages of page_size bytes.
+ * Fails right away if the pool doesn't have enough free pages. */
+static void *map_hugetlb(qfruntime *runtime, uint64_t size, uint64_t
+												 page_size, enum qf_pages pages)
+{
+#ifdef MAP_HUGETLB
+	uint64_t mapped = (size + page_size - 1) / page_size * page_size;
+	int log_page_size = __builtin_ctzll(page_size);
+	void *p = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE |
+								 MAP_ANONYMOUS | MAP_HUGETLB | (log_page_size << MAP_HUGE_SHIFT),
+								 -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+	runtime->mapped_size = mapped;
+	runtime->pages = pages;
+	return p;
+#else
+	return NULL;
+#endif
+}
+
+void *qf_alloc_buffer(qfruntime *runtime, uint64_t size)
+{
+	runtime->mapped_size = 0;
+	runtime->pages = QF_PAGES_NORMAL;
+	void *p = NULL;
+	if (use_huge_pages && size >= HUGE_PAGE_2MB) {
+		if (size >= HUGE_PAGE_1GB)
+			p = map_hugetlb(runtime, size, HUGE_PAGE_1GB, QF_PAGES_HUGETLB_1GB);
+		if (p == NULL)
+			p = map_hugetlb(runtime, size, HUGE_PAGE_2MB, QF_PAGES_HUGETLB_2MB);
+		if (p == NULL) {
+			/* The kernel backs a range with transparent huge pages only where it
+			 * covers whole aligned 2 MB pages. Map 2 MB more than needed and unmap
+			 * the unaligned ends. */
+			uint64_t mapped = (size + HUGE_PAGE_2MB - 1) / HUGE_PAGE_2MB *
+				HUGE_PAGE_2MB;
+			char *q = (char *)mmap(NULL, mapped + HUGE_PAGE_2MB, PROT_READ |
+														 PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (q != MAP_FAILED) {
+				uint64_t head = (HUGE_PAGE_2MB - (uintptr_t)q % HUGE_PAGE_2MB) %
+					HUGE_PAGE_2MB;
+				if (head)
+					munmap(q, head);
+				munmap(q + head + mapped, HUGE_PAGE_2MB - head);
+				p = q + head;
+				runtime->mapped_size = mapped;
+				qf_advise_huge_pages(runtime, p, mapped);
+			}
+		}
+	}
+	if (p == NULL)
+		p = malloc(size);
+	if (p == NULL) {
 		perror("Couldn't allocate memory for the CQF.");
 		exit(EXIT_FAILURE);
 	}
+	return p;
+}
+
+bool qf_malloc(QF *qf, uint64_t nslots, uint64_t key_bits, uint64_t
+							 value_bits, enum qf_hashmode hash, uint32_t seed)
+{
+	uint64_t total_num_bytes = qf_init(qf, nslots, key_bits, value_bits,
+																		 hash, seed, NULL, 0);
 
 	qf->runtimedata = (qfruntime *)calloc(sizeof(qfruntime), 1);
 	if (qf->runtimedata == NULL) {
 		perror("Couldn't allocate memory for runtime data.");
 		exit(EXIT_FAILURE);
 	}
+	void *buffer = qf_alloc_buffer(qf->runtimedata, total_num_bytes);
 
 	uint64_t init_size = qf_init(qf, nslots, key_bits, value_bits, hash, seed,
 															 buffer, total_num_bytes);
@@ -1776,9 +2101,13 @@ bool qf_malloc(QF *qf, uint64_t nslots, uint64_t key_bits, uint64_t
 bool qf_free(QF *qf)
 {
 	assert(qf->metadata != NULL);
+	uint64_t mapped_size = qf->runtimedata->mapped_size;
 	void *buffer = qf_destroy(qf);
 	if (buffer != NULL) {
-		free(buffer);
+		if (mapped_size)
+			munmap(buffer, mapped_size);
+		else
+			free(buffer);
 		return true;
 	}
 
@@ -1789,7 +2118,12 @@ void qf_copy(QF *dest, const QF *src)
 {
 	DEBUG_CQF("%s\n","Source CQF");
 	DEBUG_DUMP(src);
+	/* dest keeps its own memory. */
+	uint64_t mapped_size = dest->runtimedata->mapped_size;
+	enum qf_pages pages = dest->runtimedata->pages;
 	memcpy(dest->runtimedata, src->runtimedata, sizeof(qfruntime));
+	dest->runtimedata->mapped_size = mapped_size;
+	dest->runtimedata->pages = pages;
 	memcpy(dest->metadata, src->metadata, sizeof(qfmetadata));
 	memcpy(dest->blocks, src->blocks, src->metadata->total_size_in_bytes);
 	DEBUG_CQF("%s\n","Destination CQF after copy.");
@@ -1814,6 +2148,150 @@ void qf_reset(QF *qf)
 #endif
 }
 
+/* The items of src with a home slot in [start_block, end_block) of dest.
+ * They are appended to dest in order and their slots must stay in those
+ * blocks so that ranges can be filled at the same time. The items from the
+ * first one that does not fit to the end of the range are left over. */
+typedef struct copy_range {
+	const QF *src;
+	QF *dest;
+	uint64_t start_block;
+	uint64_t end_block;
+	int64_t numkeys;
+	bool has_leftovers;
+	/* The hash of the first left over item. Items with the same key and a
+	 * smaller value are in dest already. */
+	uint64_t first_leftover;
+	uint64_t first_leftover_value;
+} copy_range;
+
+/* The key of the first item with a home slot at or after slot index of
+ * dest. Keys are hashes here, so they compare in slot order. */
+static inline __uint128_t first_key_in_slot(const QF *dest, uint64_t index)
+{
+	return ((__uint128_t)index << dest->metadata->bits_per_slot) >>
+		dest->metadata->value_bits;
+}
+
+static void *copy_items_in_range(void *arg)
+{
+	copy_range *r = (copy_range *)arg;
+	const QF *src = r->src;
+	QF *dest = r->dest;
+	uint64_t start_index = r->start_block * QF_SLOTS_PER_BLOCK;
+	bool last = r->end_block == dest->metadata->nblocks;
+	uint64_t limit = last ? dest->metadata->xnslots : r->end_block *
+		QF_SLOTS_PER_BLOCK;
+	__uint128_t end_key = first_key_in_slot(dest, limit);
+
+	QFi qfi;
+	if (start_index == 0)
+		qf_iterator_from_position(src, &qfi, 0);
+	else
+		qf_iterator_from_key_value(src, &qfi, first_key_in_slot(dest,
+																														 start_index), 0,
+															 QF_KEY_IS_HASH);
+
+	uint64_t next_index = start_index;
+	r->numkeys = 0;
+	r->has_leftovers = false;
+	while (!qfi_end(&qfi)) {
+		uint64_t key, value, count;
+		qfi_get_hash(&qfi, &key, &value, &count);
+		if (!last && key >= end_key)
+			break;
+		uint64_t hash = (key << dest->metadata->value_bits) | (value &
+																													 BITMASK(dest->metadata->value_bits));
+		if (append_at(dest, hash, count, &next_index, limit) < 0) {
+			r->has_leftovers = true;
+			r->first_leftover = key;
+			r->first_leftover_value = value;
+			break;
+		}
+		r->numkeys++;
+		qfi_next(&qfi);
+	}
+	return NULL;
+}
+
+void qf_set_resize_threads(QF* qf, uint32_t num_threads)
+{
+	qf->runtimedata->resize_threads = num_threads;
+}
+
+int64_t qf_copy_items(const QF *src, QF *dest)
+{
+	/* The blocks with home slots. The last range also gets the overflow
+	 * blocks after them. */
+	uint64_t nblocks = (dest->metadata->nslots + QF_SLOTS_PER_BLOCK - 1) /
+		QF_SLOTS_PER_BLOCK;
+	uint32_t num_threads = src->runtimedata->resize_threads;
+	if (num_threads == 0)
+		num_threads = 1;
+	/* Only the items that spill out of a range are inserted one at a time, so
+	 * give each thread enough blocks that they are few. */
+	if (num_threads > nblocks / 64)
+		num_threads = nblocks / 64 > 0 ? nblocks / 64 : 1;
+
+	copy_range *ranges = (copy_range *)calloc(num_threads, sizeof(copy_range));
+	pthread_t *threads = (pthread_t *)calloc(num_threads, sizeof(pthread_t));
+	if (ranges == NULL || threads == NULL) {
+		perror("Couldn't allocate memory for the resize threads.");
+		exit(EXIT_FAILURE);
+	}
+	uint32_t i;
+	for (i = 0; i < num_threads; i++) {
+		ranges[i].src = src;
+		ranges[i].dest = dest;
+		ranges[i].start_block = nblocks * i / num_threads;
+		ranges[i].end_block = i + 1 == num_threads ? dest->metadata->nblocks :
+			nblocks * (i + 1) / num_threads;
+	}
+	for (i = 1; i < num_threads; i++)
+		if (pthread_create(&threads[i], NULL, copy_items_in_range, &ranges[i])) {
+			perror("Couldn't create a resize thread.");
+			exit(EXIT_FAILURE);
+		}
+	copy_items_in_range(&ranges[0]);
+	for (i = 1; i < num_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	/* Every range is now a valid part of dest that ends before the next one
+	 * starts. The left over items spill into the next range, so they are
+	 * inserted one at a time, which shifts the next range as needed. */
+	int64_t ret_numkeys = 0;
+	for (i = 0; i < num_threads; i++) {
+		ret_numkeys += ranges[i].numkeys;
+		if (!ranges[i].has_leftovers)
+			continue;
+		QFi qfi;
+		__uint128_t end_key = first_key_in_slot(dest, ranges[i].end_block *
+																						QF_SLOTS_PER_BLOCK);
+		qf_iterator_from_key_value(src, &qfi, ranges[i].first_leftover,
+															 ranges[i].first_leftover_value, QF_KEY_IS_HASH);
+		while (!qfi_end(&qfi)) {
+			uint64_t key, value, count;
+			qfi_get_hash(&qfi, &key, &value, &count);
+			if (i + 1 < num_threads && key >= end_key)
+				break;
+			int ret = qf_insert(dest, key, value, count, QF_NO_LOCK |
+													QF_KEY_IS_HASH);
+			if (ret < 0) {
+				fprintf(stderr, "Failed to insert key: %ld into the new CQF.\n", key);
+				ret_numkeys = ret;
+				break;
+			}
+			ret_numkeys++;
+			qfi_next(&qfi);
+		}
+		if (ret_numkeys < 0)
+			break;
+	}
+	free(ranges);
+	free(threads);
+	return ret_numkeys;
+}
+
 int64_t qf_resize_malloc(QF *qf, uint64_t nslots)
 {
 	QF new_qf;
@@ -1823,22 +2301,12 @@ int64_t qf_resize_malloc(QF *qf, uint64_t nslots)
 		return -1;
 	if (qf->runtimedata->auto_resize)
 		qf_set_auto_resize(&new_qf, true);
+	qf_set_resize_threads(&new_qf, qf->runtimedata->resize_threads);
 
 	// copy keys from qf into new_qf
-	QFi qfi;
-	qf_iterator_from_position(qf, &qfi, 0);
-	int64_t ret_numkeys = 0;
-	do {
-		uint64_t key, value, count;
-		qfi_get_hash(&qfi, &key, &value, &count);
-		qfi_next(&qfi);
-		int ret = qf_insert(&new_qf, key, value, count, QF_NO_LOCK | QF_KEY_IS_HASH);
-		if (ret < 0) {
-			fprintf(stderr, "Failed to insert key: %ld into the new CQF.\n", key);
-			return ret;
-		}
-		ret_numkeys++;
-	} while(!qfi_end(&qfi));
+	int64_t ret_numkeys = qf_copy_items(qf, &new_qf);
+	if (ret_numkeys < 0)
+		return ret_numkeys;
 
 	qf_free(qf);
 	memcpy(qf, &new_qf, sizeof(QF));
@@ -1865,20 +2333,11 @@ uint64_t qf_resize(QF* qf, uint64_t nslots, void* buffer, uint64_t buffer_len)
 
 	if (qf->runtimedata->auto_resize)
 		qf_set_auto_resize(&new_qf, true);
+	qf_set_resize_threads(&new_qf, qf->runtimedata->resize_threads);
 
 	// copy keys from qf into new_qf
-	QFi qfi;
-	qf_iterator_from_position(qf, &qfi, 0);
-	do {
-		uint64_t key, value, count;
-		qfi_get_hash(&qfi, &key, &value, &count);
-		qfi_next(&qfi);
-		int ret = qf_insert(&new_qf, key, value, count, QF_NO_LOCK | QF_KEY_IS_HASH);
-		if (ret < 0) {
-			fprintf(stderr, "Failed to insert key: %ld into the new CQF.\n", key);
-			abort();
-		}
-	} while(!qfi_end(&qfi));
+	if (qf_copy_items(qf, &new_qf) < 0)
+		abort();
 
 	qf_free(qf);
 	memcpy(qf, &new_qf, sizeof(QF));
@@ -1894,8 +2353,10 @@ void qf_set_auto_resize(QF* qf, bool enabled)
 		qf->runtimedata->auto_resize = 0;
 }
 
-int qf_insert(QF *qf, uint64_t key, uint64_t value, uint64_t count, uint8_t
-							flags)
+/* Inserts with append if sorted is set and with insert otherwise, and resizes
+ * the CQF when it fills up. */
+static int insert_and_resize(QF *qf, uint64_t key, uint64_t value, uint64_t
+														 count, uint8_t flags, bool sorted)
 {
 	// We fill up the CQF up to 95% load factor.
 	// This is a very conservative check.
@@ -1923,7 +2384,9 @@ int qf_insert(QF *qf, uint64_t key, uint64_t value, uint64_t count, uint8_t
 	uint64_t hash = (key << qf->metadata->value_bits) | (value &
 																											 BITMASK(qf->metadata->value_bits));
 	int ret;
-	if (count == 1)
+	if (sorted)
+		ret = append(qf, hash, count);
+	else if (count == 1)
 		ret = insert1(qf, hash, flags);
 	else
 		ret = insert(qf, hash, count, flags);
@@ -1939,7 +2402,9 @@ int qf_insert(QF *qf, uint64_t key, uint64_t value, uint64_t count, uint8_t
 			if (qf->runtimedata->container_resize(qf, qf->metadata->nslots * 2) > 0)
 			{
 				if (ret == QF_NO_SPACE) {
-					if (count == 1)
+					if (sorted)
+						ret = append(qf, hash, count);
+					else if (count == 1)
 						ret = insert1(qf, hash, flags);
 					else
 						ret = insert(qf, hash, count, flags);
@@ -1957,6 +2422,18 @@ int qf_insert(QF *qf, uint64_t key, uint64_t value, uint64_t count, uint8_t
 	return ret;
 }
 
+int qf_insert(QF *qf, uint64_t key, uint64_t value, uint64_t count, uint8_t
+							flags)
+{
+	return insert_and_resize(qf, key, value, count, flags, false);
+}
+
+int qf_append_sorted(QF *qf, uint64_t key, uint64_t value, uint64_t count,
+										 uint8_t flags)
+{
+	return insert_and_resize(qf, key, value, count, flags, true);
+}
+
 int qf_set_count(QF *qf, uint64_t key, uint64_t value, uint64_t count, uint8_t
 								 flags)
 {
@@ -2013,8 +2490,8 @@ int qf_delete_key_value(QF *qf, uint64_t key, uint64_t value, uint8_t flags)
 	return _remove(qf, hash, count, flags);
 }
 
-uint64_t qf_count_key_value(const QF *qf, uint64_t key, uint64_t value,
-														uint8_t flags)
+static inline uint64_t key_value_hash(const QF *qf, uint64_t key, uint64_t
+																			value, uint8_t flags)
 {
 	if (GET_KEY_HASH(flags) != QF_KEY_IS_HASH) {
 		if (qf->metadata->hash_mode == QF_HASH_DEFAULT)
@@ -2023,12 +2500,17 @@ uint64_t qf_count_key_value(const QF *qf, uint64_t key, uint64_t value,
 		else if (qf->metadata->hash_mode == QF_HASH_INVERTIBLE)
 			key = hash_64(key, BITMASK(qf->metadata->key_bits));
 	}
-	uint64_t hash = (key << qf->metadata->value_bits) | (value &
-																											 BITMASK(qf->metadata->value_bits));
-	uint64_t hash_remainder   = hash & BITMASK(qf->metadata->bits_per_slot);
-	int64_t hash_bucket_index = hash >> qf->metadata->bits_per_slot;
+	return (key << qf->metadata->value_bits) | (value &
+																							BITMASK(qf->metadata->value_bits));
+}
 
-	if (!is_occupied(qf, hash_bucket_index))
+static inline __attribute__((always_inline)) uint64_t
+count_hash_bits(const QF *qf, uint64_t hash, const uint64_t bits)
+{
+	uint64_t hash_remainder   = hash & BITMASK(bits);
+	int64_t hash_bucket_index = hash >> bits;
+
+	if (!is_occupied_bits(qf, hash_bucket_index, bits))
 		return 0;
 
 	int64_t runstart_index = hash_bucket_index == 0 ? 0 : run_end(qf,
@@ -2041,16 +2523,65 @@ uint64_t qf_count_key_value(const QF *qf, uint64_t key, uint64_t value,
 
 	uint64_t current_remainder, current_count, current_end;
 	do {
-		current_end = decode_counter(qf, runstart_index, &current_remainder,
-																 &current_count);
+		current_end = decode_counter_bits(qf, runstart_index, &current_remainder,
+																			&current_count, bits);
 		if (current_remainder == hash_remainder)
 			return current_count;
 		runstart_index = current_end + 1;
-	} while (!is_runend(qf, current_end));
+	} while (!is_runend_bits(qf, current_end, bits));
 
 	return 0;
 }
 
+static inline uint64_t count_hash(const QF *qf, uint64_t hash)
+{
+	DISPATCH_SLOT_WIDTH(qf, return count_hash_bits(qf, hash, BITS));
+}
+
+uint64_t qf_count_key_value(const QF *qf, uint64_t key, uint64_t value,
+														uint8_t flags)
+{
+	return count_hash(qf, key_value_hash(qf, key, value, flags));
+}
+
+/* How many lookups ahead qf_count_key_value_batch prefetches. It has to cover
+ * the DRAM latency with the work of the lookups in between. */
+#define BATCH_PREFETCH_DISTANCE 16
+
+/* Prefetch what count_hash reads first: the metadata of the home block and
+ * the home slot. */
+static inline void prefetch_hash(const QF *qf, uint64_t hash)
+{
+	uint64_t hash_bucket_index = hash >> qf->metadata->bits_per_slot;
+	const qfblock *b = get_block(qf, hash_bucket_index / QF_SLOTS_PER_BLOCK);
+	__builtin_prefetch(b);
+	__builtin_prefetch((const char *)b->slots + (hash_bucket_index %
+																							 QF_SLOTS_PER_BLOCK) *
+										 qf->metadata->bits_per_slot / 8);
+}
+
+void qf_count_key_value_batch(const QF *qf, const uint64_t *keys, const
+															uint64_t *values, uint64_t nkeys, uint64_t
+															*counts, uint8_t flags)
+{
+	/* The hashes of the lookups in flight, by position mod the distance. */
+	uint64_t hashes[BATCH_PREFETCH_DISTANCE];
+	for (uint64_t i = 0; i < nkeys && i < BATCH_PREFETCH_DISTANCE; i++) {
+		hashes[i] = key_value_hash(qf, keys[i], values ? values[i] : 0, flags);
+		prefetch_hash(qf, hashes[i]);
+	}
+	for (uint64_t i = 0; i < nkeys; i++) {
+		uint64_t slot = i % BATCH_PREFETCH_DISTANCE;
+		counts[i] = count_hash(qf, hashes[slot]);
+		uint64_t next = i + BATCH_PREFETCH_DISTANCE;
+		if (next < nkeys) {
+			hashes[slot] = key_value_hash(qf, keys[next], values ? values[next] : 0,
+																		flags);
+			prefetch_hash(qf, hashes[slot]);
+		}
+	}
+}
+
 uint64_t qf_query(const QF *qf, uint64_t key, uint64_t *value, uint8_t flags)
 {
 	if (GET_KEY_HASH(flags) != QF_KEY_IS_HASH) {
@@ -2283,15 +2814,21 @@ int64_t qf_iterator_from_key_value(const QF *qf, QFi *qfi, uint64_t key,
 	// starting at "position" is smaller than "hash" then find the start of the
 	// next run.
 	if (!is_occupied(qf, hash_bucket_index) || !flag) {
-		uint64_t position = hash_bucket_index;
-		assert(position < qf->metadata->nslots);
+		// The next run must start at a bucket strictly after "hash_bucket_index".
+		// Mask out the occupied bits of the earlier buckets in the block so that
+		// the iterator never lands on a run holding keys smaller than "hash".
+		uint64_t position = hash_bucket_index + 1;
+		assert(hash_bucket_index < qf->metadata->nslots);
 		uint64_t block_index = position / QF_SLOTS_PER_BLOCK;
-		uint64_t idx = bitselect(get_block(qf, block_index)->occupieds[0], 0);
-		if (idx == 64) {
-			while(idx == 64 && block_index < qf->metadata->nblocks) {
-				block_index++;
-				idx = bitselect(get_block(qf, block_index)->occupieds[0], 0);
-			}
+		uint64_t idx = 64;
+		if (block_index < qf->metadata->nblocks)
+			idx = bitselect(get_block(qf, block_index)->occupieds[0] &
+											~BITMASK(position % QF_SLOTS_PER_BLOCK), 0);
+		while (idx == 64 && ++block_index < qf->metadata->nblocks)
+			idx = bitselect(get_block(qf, block_index)->occupieds[0], 0);
+		if (block_index >= qf->metadata->nblocks) {
+			qfi->current = 0xffffffffffffffff;
+			return QFI_INVALID;
 		}
 		position = block_index * QF_SLOTS_PER_BLOCK + idx;
 		qfi->run = position;
@@ -2312,7 +2849,10 @@ static int qfi_get(const QFi *qfi, uint64_t *key, uint64_t *value, uint64_t
 		return QFI_INVALID;
 
 	uint64_t current_remainder, current_count;
-	decode_counter(qfi->qf, qfi->current, &current_remainder, &current_count);
+	DISPATCH_SLOT_WIDTH(qfi->qf, decode_counter_bits(qfi->qf, qfi->current,
+																									 &current_remainder,
+																									 &current_count, BITS);
+											break);
 
 	*value = current_remainder & BITMASK(qfi->qf->metadata->value_bits);
 	current_remainder = current_remainder >> qfi->qf->metadata->value_bits;
@@ -2352,8 +2892,11 @@ int qfi_next(QFi *qfi)
 	else {
 		/* move to the end of the current counter*/
 		uint64_t current_remainder, current_count;
-		qfi->current = decode_counter(qfi->qf, qfi->current, &current_remainder,
-																	&current_count);
+		DISPATCH_SLOT_WIDTH(qfi->qf, qfi->current =
+												decode_counter_bits(qfi->qf, qfi->current,
+																						&current_remainder, &current_count,
+																						BITS);
+												break);
 		
 		if (!is_runend(qfi->qf, qfi->current)) {
 			qfi->current++;
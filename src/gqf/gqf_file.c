@@ -132,7 +132,22 @@ uint64_t qf_usefile(QF* qf, const char* filename, int flag)
 	strcpy(qf->runtimedata->f_info.filepath, filename);
 	/* initialize container resize */
 	qf->runtimedata->container_resize = qf_resize_file;
+	/* Only the pages that are accessed are read from the file. A read-only
+	 * mapping is shared with every other process that maps the file. */
+	qf->metadata = (qfmetadata *)mmap(NULL, sb.st_size, mmap_flag, MAP_SHARED,
+																		qf->runtimedata->f_info.fd, 0);
+	if (qf->metadata == MAP_FAILED) {
+		perror("Couldn't mmap metadata.");
+		exit(EXIT_FAILURE);
+	}
+	qf_advise_huge_pages(qf->runtimedata, qf->metadata, sb.st_size);
+	if (qf->metadata->magic_endian_number != MAGIC_NUMBER) {
+		fprintf(stderr, "Can't read the CQF. It was written on a different endian machine.");
+		exit(EXIT_FAILURE);
+	}
+	qf->blocks = (qfblock *)(qf->metadata + 1);
 	/* initialize all the locks to 0 */
+	qf->runtimedata->num_locks = (qf->metadata->xnslots/NUM_SLOTS_TO_LOCK)+2;
 	qf->runtimedata->metadata_lock = 0;
 	qf->runtimedata->locks = (volatile int *)calloc(qf->runtimedata->num_locks,
 																					sizeof(volatile int));
@@ -148,17 +163,6 @@ uint64_t qf_usefile(QF* qf, const char* filename, int flag)
 		exit(EXIT_FAILURE);
 	}
 #endif
-	qf->metadata = (qfmetadata *)mmap(NULL, sb.st_size, mmap_flag, MAP_SHARED,
-																		qf->runtimedata->f_info.fd, 0);
-	if (qf->metadata == MAP_FAILED) {
-		perror("Couldn't mmap metadata.");
-		exit(EXIT_FAILURE);
-	}
-	if (qf->metadata->magic_endian_number != MAGIC_NUMBER) {
-		fprintf(stderr, "Can't read the CQF. It was written on a different endian machine.");
-		exit(EXIT_FAILURE);
-	}
-	qf->blocks = (qfblock *)(qf->metadata + 1);
 
 	pc_init(&qf->runtimedata->pc_nelts, (int64_t*)&qf->metadata->nelts, 8, 100);
 	pc_init(&qf->runtimedata->pc_ndistinct_elts, (int64_t*)&qf->metadata->ndistinct_elts, 8, 100);
@@ -192,22 +196,12 @@ int64_t qf_resize_file(QF *qf, uint64_t nslots)
 		return false;
 	if (qf->runtimedata->auto_resize)
 		qf_set_auto_resize(&new_qf, true);
+	qf_set_resize_threads(&new_qf, qf->runtimedata->resize_threads);
 
 	// copy keys from qf into new_qf
-	QFi qfi;
-	qf_iterator_from_position(qf, &qfi, 0);
-	int64_t ret_numkeys = 0;
-	do {
-		uint64_t key, value, count;
-		qfi_get_hash(&qfi, &key, &value, &count);
-		qfi_next(&qfi);
-		int ret = qf_insert(&new_qf, key, value, count, QF_NO_LOCK | QF_KEY_IS_HASH);
-		if (ret < 0) {
-			fprintf(stderr, "Failed to insert key: %ld into the new CQF.\n", key);
-			return ret;
-		}
-		ret_numkeys++;
-	} while(!qfi_end(&qfi));
+	int64_t ret_numkeys = qf_copy_items(qf, &new_qf);
+	if (ret_numkeys < 0)
+		return ret_numkeys;
 
 	// Copy old QF path in temp.
 	char *path = (char *)malloc(strlen(qf->runtimedata->f_info.filepath) + 1);
@@ -291,17 +285,13 @@ uint64_t qf_deserialize(QF *qf, const char *filename)
 		perror("Couldn't allocate memory for runtime data.");
 		exit(EXIT_FAILURE);
 	}
-	qf->metadata = (qfmetadata *)calloc(sizeof(qfmetadata), 1);
-	if (qf->metadata == NULL) {
-		perror("Couldn't allocate memory for metadata.");
-		exit(EXIT_FAILURE);
-	}
-	int ret = fread(qf->metadata, sizeof(qfmetadata), 1, fin);
+	qfmetadata metadata;
+	int ret = fread(&metadata, sizeof(qfmetadata), 1, fin);
 	if (ret < 1) {
 		perror("Couldn't read metadata from file.");
 		exit(EXIT_FAILURE);
 	}
-	if (qf->metadata->magic_endian_number != MAGIC_NUMBER) {
+	if (metadata.magic_endian_number != MAGIC_NUMBER) {
 		fprintf(stderr, "Can't read the CQF. It was written on a different endian machine.");
 		exit(EXIT_FAILURE);
 	}
@@ -313,7 +303,7 @@ uint64_t qf_deserialize(QF *qf, const char *filename)
 	}
 	strcpy(qf->runtimedata->f_info.filepath, filename);
 	/* initlialize the locks in the QF */
-	qf->runtimedata->num_locks = (qf->metadata->xnslots/NUM_SLOTS_TO_LOCK)+2;
+	qf->runtimedata->num_locks = (metadata.xnslots/NUM_SLOTS_TO_LOCK)+2;
 	qf->runtimedata->metadata_lock = 0;
 	/* initialize all the locks to 0 */
 	qf->runtimedata->locks = (volatile int *)calloc(qf->runtimedata->num_locks,
@@ -322,13 +312,10 @@ uint64_t qf_deserialize(QF *qf, const char *filename)
 		perror("Couldn't allocate memory for runtime locks.");
 		exit(EXIT_FAILURE);
 	}
-	qf->metadata = (qfmetadata *)realloc(qf->metadata,
-																			 qf->metadata->total_size_in_bytes +
-																			 sizeof(qfmetadata));
-	if (qf->metadata == NULL) {
-		perror("Couldn't allocate memory for metadata.");
-		exit(EXIT_FAILURE);
-	}
+	qf->metadata = (qfmetadata *)qf_alloc_buffer(qf->runtimedata,
+																							 metadata.total_size_in_bytes +
+																							 sizeof(qfmetadata));
+	memcpy(qf->metadata, &metadata, sizeof(qfmetadata));
 	qf->blocks = (qfblock *)(qf->metadata + 1);
 	if (qf->blocks == NULL) {
 		perror("Couldn't allocate memory for blocks.");
@@ -370,6 +357,15 @@ static void make_madvise_calls(const QF *qf, uint64_t oldrun, uint64_t newrun)
   }
 }
 
+/* Call madvise(DONTNEED) on the whole mmapped CQF. The pages come back
+   from the file (or the page cache) on the next access; dirty pages of a
+   shared mapping are written back, not lost. */
+int qf_drop_pages(const QF *qf)
+{
+  uint64_t size = qf->metadata->total_size_in_bytes + sizeof(qfmetadata);
+  return madvise(qf->metadata, size, MADV_DONTNEED);
+}
+
 /* This wraps qfi_next, using madvise(DONTNEED) to reduce our RSS.
    Only valid on mmapped QFs, i.e. cqfs from qf_initfile and
    qf_usefile. */
@@ -71,7 +71,10 @@ void pc_sync(pc_t *pc) {
 	for (uint32_t i = 0; i < pc->num_counters; i++) {
 		int64_t c = __atomic_exchange_n(&pc->local_counters[i].counter, 0,
 																		__ATOMIC_SEQ_CST);
-		__atomic_fetch_add(pc->global_counter, c, __ATOMIC_SEQ_CST);
+		/* Don't touch the global counter if there is nothing to add. It can be
+		 * in a read-only mapping. */
+		if (c)
+			__atomic_fetch_add(pc->global_counter, c, __ATOMIC_SEQ_CST);
 	}
 }
 
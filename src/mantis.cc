@@ -50,6 +50,10 @@ int mst_query_main(QueryOpts &opt);
 int query_main (QueryOpts& opt);
 int validate_mst_main(MSTValidateOpts &opt);
 int stats_main(StatsOpts& statsOpts);
+int reorder_main(ReorderOpts& opt);
+int add_main(AddOpts& opt);
+int merge_main(MergeOpts& opt);
+int serve_main(ServeOpts& opt);
 
 /*
  * ===  FUNCTION  =============================================================
@@ -59,7 +63,7 @@ int stats_main(StatsOpts& statsOpts);
  */
 int main ( int argc, char *argv[] ) {
   using namespace clipp;
-  enum class mode {build, build_mst, validate_mst, query, validate, stats, help};
+  enum class mode {build, build_mst, validate_mst, query, validate, stats, reorder, add, merge, serve, help};
   mode selected = mode::help;
 
   auto console = spdlog::stdout_color_mt("mantis_console");
@@ -69,11 +73,19 @@ int main ( int argc, char *argv[] ) {
   ValidateOpts vopt;
   MSTValidateOpts mvopt;
   StatsOpts sopt;
+  ReorderOpts ropt;
+  AddOpts aopt;
+  MergeOpts mgopt;
+  ServeOpts svopt;
   bopt.console = console;
   qopt.console = console;
   vopt.console = console;
   mvopt.console = console;
   sopt.console = console;
+  ropt.console = console;
+  aopt.console = console;
+  mgopt.console = console;
+  svopt.console = console;
 
   auto ensure_file_exists = [](const std::string& s) -> bool {
     bool exists = mantis::fs::FileExists(s.c_str());
@@ -96,15 +108,21 @@ int main ( int argc, char *argv[] ) {
   auto build_mode = (
                      command("build").set(selected, mode::build),
                      option("-e", "--eqclass_dist").set(bopt.flush_eqclass_dist) % "write the eqclass abundance distribution",
-										 required("-s","--log-slots") & value("log-slots",
-																											 bopt.qbits) % "log of number of slots in the output CQF",
+										 option("-s","--log-slots") & value("log-slots",
+																											 bopt.qbits) % "log of number of slots in the output CQF (estimated from the inputs if not given)",
                      required("-i", "--input-list") & value(ensure_file_exists, "input_list", bopt.inlist) % "file containing list of input filters",
-                     required("-o", "--output") & value("build_output", bopt.out) % "directory where results should be written"
+                     required("-o", "--output") & value("build_output", bopt.out) % "directory where results should be written",
+                     option("-t", "--threads") & value("num_threads", bopt.numthreads) % "number of threads used to merge the input CQFs",
+                     option("-r", "--no-restart").set(bopt.no_restart) % "keep the k-mers merged in the sampling phase instead of merging them again",
+                     option("-g", "--group-size") & value("group_size", bopt.group_size) % "build in two levels, merging at most this many input filters at a time",
+                     option("-m", "--max-memory") & value("max_memory", bopt.max_memory) % "memory budget in GB for the color class buffers",
+                     option("-l", "--mem-limit") & value("mem_limit", bopt.mem_limit) % "memory budget in GB for the whole build (advisory)"
                      );
   auto build_mst_mode = (
           command("mst").set(selected, mode::build_mst),
                   required("-p", "--index-prefix") & value(ensure_dir_exists, "index_prefix", qopt.prefix) % "The directory where the index is stored.",
                   option("-t", "--threads") & value("num_threads", qopt.numThreads) % "number of threads",
+                  option("-H", "--huge-pages").set(qopt.huge_pages) % "load the CQF into huge pages",
                   (
                           required("-k", "--keep-RRR").set(qopt.keep_colorclasses) % "Keep the previous color class RRR representation."
                           |
@@ -125,6 +143,9 @@ int main ( int argc, char *argv[] ) {
                      % "Use color classes as the color info representation instead of MST",
                      option("-j", "--json").set(qopt.use_json) % "Write the output in JSON format",
                      option("-k", "--kmer") & value("kmer", qopt.k) % "size of k for kmer.",
+                     option("-t", "--threads") & value("num_threads", qopt.numThreads) % "number of threads used to query the MST",
+                     option("-H", "--huge-pages").set(qopt.huge_pages) % "load the CQF into huge pages instead of mapping it",
+                     option("-N", "--numa").set(qopt.numa) % "interleave the index over the NUMA nodes and pin the query threads to them",
                      required("-p", "--input-prefix") & value(ensure_dir_exists, "query_prefix", qopt.prefix) % "Prefix of input files.",
                      option("-o", "--output") & value("output_file", qopt.output) % "Where to write query output.",
                      value(ensure_file_exists, "query", qopt.query_file) % "Prefix of input files."
@@ -144,8 +165,50 @@ int main ( int argc, char *argv[] ) {
                     option("-j", "--jmer-length") & value("size-of-jmer", sopt.j) % "value of j for constituent jmers of a kmer (default: 23)."
     );
 
+  auto reorder_mode = (
+          command("reorder").set(selected, mode::reorder),
+                  required("-p", "--index-prefix") & value(ensure_dir_exists, "index_prefix", ropt.prefix) % "The directory where the index is stored."
+  );
+
+  auto add_mode = (
+          command("add").set(selected, mode::add),
+                  required("-p", "--index-prefix") & value(ensure_dir_exists, "index_prefix", aopt.prefix) % "The directory where the index is stored.",
+                  required("-i", "--input-list") & value(ensure_file_exists, "input_list", aopt.inlist) % "file containing list of input filters to add",
+                  required("-o", "--output") & value("add_output", aopt.out) % "directory where the new index should be written",
+                  option("-t", "--threads") & value("num_threads", aopt.numthreads) % "number of threads used to merge the inputs",
+                  option("-r", "--no-restart").set(aopt.no_restart) % "keep the k-mers merged in the sampling phase instead of merging them again",
+                  option("-m", "--max-memory") & value("max_memory", aopt.max_memory) % "memory budget in GB for the color class buffers"
+  );
+
+  auto merge_mode = (
+          command("merge").set(selected, mode::merge),
+                  required("-a", "--first-prefix") & value(ensure_dir_exists, "first_prefix", mgopt.first_prefix) % "The directory where the first index is stored.",
+                  required("-b", "--second-prefix") & value(ensure_dir_exists, "second_prefix", mgopt.second_prefix) % "The directory where the second index is stored.",
+                  required("-o", "--output") & value("merge_output", mgopt.out) % "directory where the merged index should be written",
+                  option("-t", "--threads") & value("num_threads", mgopt.numthreads) % "number of threads used to merge the indexes",
+                  option("-r", "--no-restart").set(mgopt.no_restart) % "keep the k-mers merged in the sampling phase instead of merging them again",
+                  option("-m", "--max-memory") & value("max_memory", mgopt.max_memory) % "memory budget in GB for the color class buffers"
+  );
+
+  auto serve_mode = (
+          command("serve").set(selected, mode::serve),
+                  required("-p", "--index-prefix") & value(ensure_dir_exists, "index_prefix", svopt.prefix) % "The directory where the index is stored.",
+                  (
+                          required("-s", "--socket") & value("socket_path", svopt.socket_path) % "Unix domain socket to listen on."
+                          |
+                          required("-P", "--port") & value("port", svopt.port) % "TCP port to listen on at 127.0.0.1."
+                  ),
+                  option("-t", "--threads") & value("num_threads", svopt.numThreads) % "number of worker threads",
+                  option("-m", "--max-request") & value("max_request", svopt.max_request) % "largest request in MB, 0 for no limit (default: 64)",
+                  option("-T", "--timeout") & value("timeout", svopt.timeout) % "seconds a client has to send its request, 0 for no limit (default: 30)",
+                  option("-j", "--json").set(svopt.use_json) % "Write the results in JSON format",
+                  option("-k", "--kmer") & value("kmer", svopt.k) % "size of k for kmer.",
+                  option("-H", "--huge-pages").set(svopt.huge_pages) % "load the CQF into huge pages instead of mapping it",
+                  option("-N", "--numa").set(svopt.numa) % "interleave the index over the NUMA nodes and pin the workers to them"
+  );
+
   auto cli = (
-              (build_mode | build_mst_mode | validate_mst_mode | query_mode | validate_mode | stats_mode | command("help").set(selected,mode::help) |
+              (build_mode | build_mst_mode | validate_mst_mode | query_mode | validate_mode | stats_mode | reorder_mode | add_mode | merge_mode | serve_mode | command("help").set(selected,mode::help) |
                option("-v", "--version").call([]{std::cout << "mantis " << mantis::version << '\n'; std::exit(0);}).doc("show version")
               )
              );
@@ -156,6 +219,10 @@ int main ( int argc, char *argv[] ) {
   assert(build_mst_mode.flags_are_prefix_free());
   assert(validate_mst_mode.flags_are_prefix_free());
   assert(stats_mode.flags_are_prefix_free());
+  assert(reorder_mode.flags_are_prefix_free());
+  assert(add_mode.flags_are_prefix_free());
+  assert(merge_mode.flags_are_prefix_free());
+  assert(serve_mode.flags_are_prefix_free());
 
   decltype(parse(argc, argv, cli)) res;
   try {
@@ -177,6 +244,10 @@ int main ( int argc, char *argv[] ) {
     case mode::query: qopt.use_colorclasses? query_main(qopt):mst_query_main(qopt);  break;
     case mode::validate: validate_main(vopt);  break;
     case mode::stats: stats_main(sopt);  break;
+    case mode::reorder: reorder_main(ropt);  break;
+    case mode::add: add_main(aopt);  break;
+    case mode::merge: merge_main(mgopt);  break;
+    case mode::serve: serve_main(svopt);  break;
     case mode::help: std::cout << make_man_page(cli, "mantis"); break;
     }
   } else {
@@ -195,6 +266,14 @@ int main ( int argc, char *argv[] ) {
         std::cout << make_man_page(validate_mode, "mantis");
       } else if (b->arg() == "stats") {
         std::cout << make_man_page(stats_mode, "mantis");
+      } else if (b->arg() == "reorder") {
+        std::cout << make_man_page(reorder_mode, "mantis");
+      } else if (b->arg() == "add") {
+        std::cout << make_man_page(add_mode, "mantis");
+      } else if (b->arg() == "merge") {
+        std::cout << make_man_page(merge_mode, "mantis");
+      } else if (b->arg() == "serve") {
+        std::cout << make_man_page(serve_mode, "mantis");
       } else {
         std::cout << "There is no command \"" << b->arg() << "\"\n";
         std::cout << usage_lines(cli, "mantis") << '\n';
@@ -10,6 +10,7 @@
 
 #include "MantisFS.h"
 #include "mst.h"
+#include "mstQuery.h"
 #include "ProgOpts.h"
 
 #define MAX_ALLOWED_TMP_EDGES 31250000
@@ -28,6 +29,7 @@ MST::MST(std::string prefixIn, std::shared_ptr<spdlog::logger> loggerIn, uint32_
         std::exit(1);
     }
 
+    check_index_version(prefix, logger);
     eqclass_files =
             mantis::fs::GetFilesExt(prefix.c_str(), mantis::EQCLASS_FILE);
 
@@ -45,6 +47,7 @@ MST::MST(std::string prefixIn, std::shared_ptr<spdlog::logger> loggerIn, uint32_
     });
 
     num_of_ccBuffers = eqclass_files.size();
+    num_bv_buffer = read_num_bv_buffer(prefix);
 
     std::string sample_file = prefix + mantis::SAMPLEID_FILE;//(prefix.c_str() , mantis::SAMPLEID_FILE);
     std::ifstream sampleid(sample_file);
@@ -86,9 +89,11 @@ bool MST::buildEdgeSets() {
     CQF<KeyObject> cqf(cqf_file, CQF_FREAD);
     k = cqf.keybits() / 2;
     logger->info("Done loading cdbg. k is {}", k);
+    if (cqf.pages() != QF_PAGES_NORMAL)
+        logger->info("The cdbg is in {} pages.", qf_pages_name(cqf.pages()));
     logger->info("Iterating over cqf & building edgeSet ...");
     // max possible value and divisible by 64
-    sdsl::bit_vector nodes((1 + (num_of_ccBuffers * mantis::NUM_BV_BUFFER) / 64) * 64, 0);
+    sdsl::bit_vector nodes((1 + (num_of_ccBuffers * num_bv_buffer) / 64) * 64, 0);
     uint64_t maxId{0}, numOfKmers{0};
 
     // build color class edges in a multi-threaded manner
@@ -239,11 +244,11 @@ bool MST::calculateWeights() {
     uint64_t numEdges = 0;
     weightBuckets.resize(numSamples);
     for (auto i = 0; i < eqclass_files.size(); i++) {
-        BitVectorRRR bv1;
+        HybridColorClasses bv1;
         sdsl::load_from_file(bv1, eqclass_files[i]);
         bvp1 = &bv1;
         for (auto j = i; j < eqclass_files.size(); j++) {
-            BitVectorRRR bv2;
+            HybridColorClasses bv2;
             auto &edgeBucket = edgeBucketList[i * num_of_ccBuffers + j];
             if (i == j) {
                 bvp2 = bvp1;
@@ -430,11 +435,11 @@ bool MST::encodeColorClassUsingMST() {
     sdsl::int_vector<> deltabv(mstTotalWeight, 0, ceil(log2(numSamples)));
     sdsl::bit_vector::select_1_type sbbv = sdsl::bit_vector::select_1_type(&bbv);
     for (auto i = 0; i < eqclass_files.size(); i++) {
-        BitVectorRRR bv1;
+        HybridColorClasses bv1;
         sdsl::load_from_file(bv1, eqclass_files[i]);
         bvp1 = &bv1;
         for (auto j = i; j < eqclass_files.size(); j++) {
-            BitVectorRRR bv2;
+            HybridColorClasses bv2;
             if (i == j) {
                 bvp2 = bvp1;
             } else {
@@ -464,6 +469,7 @@ bool MST::encodeColorClassUsingMST() {
     sdsl::store_to_file(parentbv, std::string(prefix + mantis::PARENTBV_FILE));
     sdsl::store_to_file(deltabv, std::string(prefix + mantis::DELTABV_FILE));
     sdsl::store_to_file(bbv, std::string(prefix + mantis::BOUNDARYBV_FILE));
+    store_boundary_select(sbbv, bbv, prefix + mantis::BOUNDARYSEL_FILE);
     logger->info("Done Serializing.");
     return true;
 }
@@ -527,36 +533,24 @@ void MST::findNeighborEdges(CQF<KeyObject> &cqf, KeyObject &keyobj, std::vector<
  */
 std::set<workItem> MST::neighbors(CQF<KeyObject> &cqf, workItem n) {
     std::set<workItem> result;
+    // Look the 8 neighbors up in one batch so that their cache misses overlap.
+    constexpr uint64_t numNeighbors = 2 * 4;
+    dna::canonical_kmer nodes[numNeighbors];
+    uint64_t keys[numNeighbors], eqids[numNeighbors];
+    uint64_t cnt{0};
     for (const auto b : dna::bases) {
-        uint64_t eqid = 0;
-        if (exists(cqf, n.node << b, eqid)) {
-            if (eqid != n.colorId)
-                result.insert(workItem(n.node << b, eqid));
-        }
-        if (exists(cqf, b >> n.node, eqid)) {
-            if (eqid != n.colorId)
-                result.insert(workItem(b >> n.node, eqid));
-        }
+        nodes[cnt++] = n.node << b;
+        nodes[cnt++] = b >> n.node;
     }
-    return result;
-}
-
-/**
- * searches for a kmer in cqf and returns the correct colorId if found
- * which is cqf count value - 1
- * @param cqf
- * @param e : search canonical kmer
- * @param eqid : reference to eqid that'll be set
- * @return true if eqid is found
- */
-bool MST::exists(CQF<KeyObject> &cqf, dna::canonical_kmer e, uint64_t &eqid) {
-    KeyObject key(e.val, 0, 0);
-    auto eqidtmp = cqf.query(key, QF_NO_LOCK /*QF_KEY_IS_HASH | QF_NO_LOCK*/);
-    if (eqidtmp) {
-        eqid = eqidtmp - 1;
-        return true;
+    for (uint64_t i = 0; i < numNeighbors; i++)
+        keys[i] = nodes[i].val;
+    cqf.query_batch(keys, numNeighbors, eqids, QF_NO_LOCK);
+    for (uint64_t i = 0; i < numNeighbors; i++) {
+        // The count in the cqf is the colorId + 1.
+        if (eqids[i] and eqids[i] - 1 != n.colorId)
+            result.insert(workItem(nodes[i], eqids[i] - 1));
     }
-    return false;
+    return result;
 }
 
 /**
@@ -624,7 +618,7 @@ std::vector<uint32_t> MST::getDeltaList(uint64_t eqid1, uint64_t eqid2) {
  * @param eqid color id
  * @param bv the large bv collapsing all eq ids color bv in a bucket
  */
-void MST::buildColor(std::vector<uint64_t> &eq, uint64_t eqid, BitVectorRRR *bv) {
+void MST::buildColor(std::vector<uint64_t> &eq, uint64_t eqid, HybridColorClasses *bv) {
     if (eqid == zero) return;
     /* colorMutex.lock();
      if (lru_cache.contains(eqid)) {
@@ -634,14 +628,7 @@ void MST::buildColor(std::vector<uint64_t> &eq, uint64_t eqid, BitVectorRRR *bv)
          return;
      }
      colorMutex.unlock();*/
-    uint64_t i{0}, bitcnt{0}, wrdcnt{0};
-    uint64_t offset = eqid % mantis::NUM_BV_BUFFER;
-    while (i < numSamples) {
-        bitcnt = std::min(numSamples - i, (uint64_t) 64);
-        uint64_t wrd = bv->get_int(offset * numSamples + i, bitcnt);
-        eq[wrdcnt++] = wrd;
-        i += bitcnt;
-    }
+    bv->get_words(eqid % num_bv_buffer, eq.data());
 //    colorMutex.lock();
 //    lru_cache.emplace(eqid, eq);
 //    colorMutex.unlock();
@@ -657,8 +644,8 @@ inline uint64_t MST::getBucketId(uint64_t c1, uint64_t c2) {
     if (c1 == zero or c1 > c2) {
         std::swap(c1, c2);
     }
-    uint64_t cb1 = c1 / mantis::NUM_BV_BUFFER;
-    uint64_t cb2 = c2 / mantis::NUM_BV_BUFFER;
+    uint64_t cb1 = c1 / num_bv_buffer;
+    uint64_t cb2 = c2 / num_bv_buffer;
     if (c2 == zero) // return the corresponding buffer for the non-zero colorId
         return cb1 * num_of_ccBuffers + cb1;
     return cb1 * num_of_ccBuffers + cb2;
@@ -669,6 +656,7 @@ inline uint64_t MST::getBucketId(uint64_t c1, uint64_t c2) {
  * main function to call Color graph and MST construction and color class encoding and serializing
  */
 int build_mst_main(QueryOpts &opt) {
+    qf_set_huge_pages(opt.huge_pages);
     MST mst(opt.prefix, opt.console, opt.numThreads);
     mst.buildMST();
     if (opt.remove_colorClasses && !opt.keep_colorclasses) {
@@ -2,27 +2,148 @@
 // Created by Fatemeh Almodaresi on 2018-10-15.
 //
 #include <fstream>
+#include <sstream>
 #include <vector>
+#include <thread>
+#include <atomic>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include <CLI/Timer.hpp>
 #include <canonicalKmer.h>
 #include <sparsepp/spp.h>
 
 #include "ProgOpts.h"
+#include "MantisNuma.h"
 #include "kmer.h"
 #include "mstQuery.h"
+#include "gqf/hashutil.h"
+
+/* Hashes the size of bbv and at most 4096 evenly spaced words of it. Only
+ * those words are read, so the check does not page in the whole vector. */
+static uint64_t boundary_checksum(const sdsl::bit_vector &bbv) {
+    const uint64_t maxWords = 4096;
+    uint64_t numWords = (bbv.size() + 63) / 64;
+    uint64_t step = std::max((uint64_t)1, numWords / maxWords);
+    std::vector<uint64_t> wrds{bbv.size()};
+    for (uint64_t w = 0; w < numWords; w += step)
+        wrds.push_back(bbv.get_int(w * 64, std::min((uint64_t)64,
+                                                   bbv.size() - w * 64)));
+    if (numWords > 0)
+        wrds.push_back(bbv.get_int((numWords - 1) * 64,
+                                   bbv.size() - (numWords - 1) * 64));
+    return MurmurHash64A(wrds.data(), wrds.size() * sizeof(uint64_t),
+                         2038074743);
+}
+
+void store_boundary_select(const sdsl::bit_vector::select_1_type &sbbv,
+                           const sdsl::bit_vector &bbv, std::string filename) {
+    std::ofstream out(filename, std::ios::binary);
+    uint64_t size = bbv.size(), checksum = boundary_checksum(bbv);
+    sdsl::write_member(size, out);
+    sdsl::write_member(checksum, out);
+    sbbv.serialize(out);
+}
+
+bool load_boundary_select(sdsl::bit_vector::select_1_type &sbbv,
+                          const sdsl::bit_vector &bbv, std::string filename) {
+    std::ifstream in(filename, std::ios::binary);
+    if (!in.is_open())
+        return false;
+    uint64_t size{0}, checksum{0};
+    sdsl::read_member(size, in);
+    sdsl::read_member(checksum, in);
+    if (!in || size != bbv.size() || checksum != boundary_checksum(bbv))
+        return false;
+    sbbv.load(in, &bbv);
+    return (bool)in;
+}
+
+/* Asks for transparent huge pages on the mapped pages that hold v. Only
+ * file systems that keep huge pages in the page cache honor it. */
+template <class Vector>
+static void advise_huge_pages(const Vector &v) {
+    uintptr_t pageSize = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)v.data() & ~(pageSize - 1);
+    uintptr_t end = (uintptr_t)v.data() + (v.bit_size() + 7) / 8;
+#ifdef MADV_HUGEPAGE
+    madvise((void *)start, end - start, MADV_HUGEPAGE);
+#endif
+}
 
-void MSTQuery::loadIdx(std::string indexDir) {
-    sdsl::load_from_file(parentbv, indexDir + mantis::PARENTBV_FILE);
-    sdsl::load_from_file(deltabv, indexDir + mantis::DELTABV_FILE);
-    sdsl::load_from_file(bbv, indexDir + mantis::BOUNDARYBV_FILE);
-    sbbv = sdsl::bit_vector::select_1_type(&bbv);
-    zero = parentbv.size() - 1; // maximum color id which
+MSTIndex::MSTIndex(std::string prefix, spdlog::logger *logger,
+                   bool hugePages) :
+    parentbvMap(prefix + mantis::PARENTBV_FILE),
+    deltabvMap(prefix + mantis::DELTABV_FILE),
+    bbvMap(prefix + mantis::BOUNDARYBV_FILE),
+    parentbv(parentbvMap.wrapper()), deltabv(deltabvMap.wrapper()),
+    bbv(bbvMap.wrapper()) {
+    if (hugePages) {
+        advise_huge_pages(parentbv);
+        advise_huge_pages(deltabv);
+        advise_huge_pages(bbv);
+    }
+    if (!load_boundary_select(sbbv, bbv, prefix + mantis::BOUNDARYSEL_FILE)) {
+        logger->warn("The stored select structure for {} is missing or out of date. Building it. Run mantis mst again to store it.",
+                     mantis::BOUNDARYBV_FILE);
+        sbbv = sdsl::bit_vector::select_1_type(&bbv);
+    }
     logger->info("Loaded the new color class index");
     logger->info("\t--> parent size: {}", parentbv.size());
     logger->info("\t--> delta size: {}", deltabv.size());
     logger->info("\t--> boundary size: {}", bbv.size());
 }
 
+/* Reads a byte of every page of v. */
+template <class Vector>
+static uint64_t touch_pages(const Vector &v) {
+    uint64_t pageSize = sysconf(_SC_PAGESIZE), sum{0};
+    const volatile char *data = (const volatile char *)v.data();
+    uint64_t bytes = (v.bit_size() + 7) / 8;
+    for (uint64_t i = 0; i < bytes; i += pageSize)
+        sum += data[i];
+    return sum;
+}
+
+void MSTIndex::prefault() const {
+    touch_pages(parentbv);
+    touch_pages(deltabv);
+    touch_pages(bbv);
+}
+
+std::vector<uint32_t> interleave_index_memory(bool numa,
+                                              spdlog::logger *logger) {
+    if (!numa)
+        return {};
+    std::vector<uint32_t> nodes = mantis::numa::Nodes();
+    if (nodes.size() < 2) {
+        logger->info("There is no second NUMA node. Nothing to interleave.");
+        return {};
+    }
+    if (!mantis::numa::InterleaveMemory(nodes)) {
+        logger->warn("Couldn't interleave memory over the NUMA nodes: {}",
+                     strerror(errno));
+        return {};
+    }
+    logger->info("Interleaving the index over {} NUMA nodes.", nodes.size());
+    return nodes;
+}
+
+void place_workers(const std::vector<uint32_t> &nodes,
+                   std::vector<std::unique_ptr<QueryWorker>> &workers,
+                   spdlog::logger *logger) {
+    if (nodes.empty())
+        return;
+    // The caches of the workers are filled by the threads that run them, so
+    // they end up on the node of their worker.
+    if (!mantis::numa::LocalMemory())
+        logger->warn("Couldn't restore the local memory policy: {}",
+                     strerror(errno));
+    for (uint64_t i = 0; i < workers.size(); i++)
+        workers[i]->numaNode = nodes[i % nodes.size()];
+}
+
 std::vector<uint64_t> MSTQuery::buildColor(uint64_t eqid, QueryStats &queryStats,
                                            LRUCacheMap *lru_cache,
                                            RankScores *rs,
@@ -83,7 +204,8 @@ std::vector<uint64_t> MSTQuery::buildColor(uint64_t eqid, QueryStats &queryStats
         auto start = f;
         //std::cerr << "\n" << start << ": ";
         do {
-            wrd = bbv.get_int(start, 64);
+            // Don't read past the mapped vector. The last bit of bbv is set.
+            wrd = bbv.get_int(start, std::min((uint64_t)64, bbv.size() - start));
             for (uint64_t j = 0; j < 64; j++) {
                 //std::cerr << deltabv[start + j] << " ";
                 flips[deltabv[start + j]] ^= 0x01;
@@ -114,10 +236,16 @@ void MSTQuery::findSamples(CQF<KeyObject> &dbg,
     mantis::EqMap query_eqclass_map;
     std::unordered_set<uint64_t> query_eqclass_set;
 //    std::cerr << "\n\nkmer2cidMap size: " << kmer2cidMap.size() << "\n\n";
+    // Look all k-mers of the query up at once so the CQF can overlap the
+    // cache misses of the lookups.
+    std::vector<uint64_t> keys, eqclasses(kmer2cidMap.size());
+    keys.reserve(kmer2cidMap.size());
+    for (auto &kv : kmer2cidMap)
+        keys.push_back(kv.first);
+    dbg.query_batch(keys.data(), keys.size(), eqclasses.data(), 0);
+    uint64_t i{0};
     for (auto &kv : kmer2cidMap) {
-        KeyObject key(kv.first, 0, 0);
-//        std::cerr << std::string(dna::canonical_kmer(dbg.keybits()/2, key.key)) << "\n";
-        uint64_t eqclass = dbg.query(key, 0);
+        uint64_t eqclass = eqclasses[i++];
         if (eqclass) {
             kv.second = eqclass - 1;
             query_eqclass_set.insert(eqclass - 1);
@@ -375,7 +503,7 @@ mantis::QueryResult MSTQuery::getResultList() {
 }
 
 void output_results(MSTQuery &mstQuery,
-                    std::ofstream &opfile,
+                    std::ostream &opfile,
                     std::vector<std::string> &sampleNames,
                     QueryStats &queryStats) {
     //CLI::AutoTimer timer{"Second round going over the file + query time ", CLI::Timer::Big};
@@ -388,35 +516,41 @@ void output_results(MSTQuery &mstQuery,
     }
 }
 
+/* Writes one result as an element of a JSON array. Every element but the
+ * first is preceded by a comma, so the array is closed with "\n]". */
+static void write_result_json(std::ostream &opfile, uint64_t qnum,
+                              uint64_t numKmers,
+                              const mantis::QueryResult &result,
+                              std::vector<std::string> &sampleNames,
+                              bool first) {
+    if (!first)
+        opfile << ",\n";
+    opfile << "{ \"qnum\": " << qnum << ",  \"num_kmers\": " << numKmers
+           << ", \"res\": {";
+    bool firstSample = true;
+    for (uint64_t i = 0; i < result.size(); i++) {
+        if (result[i] == 0)
+            continue;
+        opfile << (firstSample ? "\n" : ",\n") << " \"" << sampleNames[i]
+               << "\": " << result[i];
+        firstSample = false;
+    }
+    opfile << "}}";
+}
+
 void output_results_json(MSTQuery &mstQuery,
-                         std::ofstream &opfile,
+                         std::ostream &opfile,
                          std::vector<std::string> &sampleNames,
                          QueryStats &queryStats,
-                         uint64_t nquery) {
-    uint64_t qctr{0};
+                         bool first) {
     //CLI::AutoTimer timer{"Query time ", CLI::Timer::Big};
-    opfile << "{ \"qnum\": " << queryStats.cnt++ << ",  \"num_kmers\": "
-           << mstQuery.getNumOfDistinctKmers() << ", \"res\": {\n";
-    mantis::QueryResult result = mstQuery.getResultList();
-    uint64_t kmerCntr = 0;
-    for (auto it = result.begin(); it != result.end(); ++it) {
-        if (*it > 0)
-            opfile << " \"" << sampleNames[kmerCntr] << "\": " << *it;
-        if (std::next(it) != result.end()) {
-            opfile << ",\n";
-        }
-        kmerCntr++;
-    }
-    opfile << "}}";
-    if (qctr < nquery - 1) {
-        opfile << ",";
-    }
-    opfile << "\n";
-    ++qctr;
+    write_result_json(opfile, queryStats.cnt++,
+                      mstQuery.getNumOfDistinctKmers(),
+                      mstQuery.getResultList(), sampleNames, first);
 }
 void output_results(std::string &read,
                     MSTQuery &mstQuery,
-                    std::ofstream &opfile,
+                    std::ostream &opfile,
                     std::vector<std::string> &sampleNames,
                     QueryStats &queryStats) {
     opfile << "seq" << queryStats.cnt++ << '\t' << read.length() << '\n';
@@ -430,30 +564,34 @@ void output_results(std::string &read,
 
 void output_results_json(std::string &read,
                          MSTQuery &mstQuery,
-                         std::ofstream &opfile,
+                         std::ostream &opfile,
                          std::vector<std::string> &sampleNames,
                          QueryStats &queryStats,
-                         uint64_t nquery) {
-    uint64_t qctr{0};
+                         bool first) {
     //CLI::AutoTimer timer{"Query time ", CLI::Timer::Big};
-    opfile << "{ \"qnum\": " << queryStats.cnt++ << ",  \"num_kmers\": "
-           << read.length() << ", \"res\": {\n";
-    mantis::QueryResult result = mstQuery.convertIndexK2QueryK(read);
-    uint64_t kmerCntr = 0;
-    for (auto it = result.begin(); it != result.end(); ++it) {
-        if (*it > 0)
-            opfile << " \"" << sampleNames[kmerCntr] << "\": " << *it;
-        if (std::next(it) != result.end()) {
-            opfile << ",\n";
-        }
-        kmerCntr++;
-    }
-    opfile << "}}";
-    if (qctr < nquery - 1) {
-        opfile << ",";
+    write_result_json(opfile, queryStats.cnt++, read.length(),
+                      mstQuery.convertIndexK2QueryK(read), sampleNames, first);
+}
+
+void query_sequence(std::string &read, MSTQuery &mstQuery,
+                    CQF<KeyObject> &cqf, LRUCacheMap &cache_lru,
+                    RankScores &rs, QueryStats &queryStats,
+                    std::vector<std::string> &sampleNames, bool use_json,
+                    bool first, std::ostream &opfile) {
+    mstQuery.reset();
+    mstQuery.parseKmers(read, mstQuery.indexK);
+    mstQuery.findSamples(cqf, cache_lru, &rs, queryStats);
+    if (use_json) {
+        if (mstQuery.indexK == mstQuery.queryK)
+            output_results_json(mstQuery, opfile, sampleNames, queryStats, first);
+        else
+            output_results_json(read, mstQuery, opfile, sampleNames, queryStats, first);
+    } else {
+        if (mstQuery.indexK == mstQuery.queryK)
+            output_results(mstQuery, opfile, sampleNames, queryStats);
+        else
+            output_results(read, mstQuery, opfile, sampleNames, queryStats);
     }
-    opfile << "\n";
-    ++qctr;
 }
 
 std::vector<std::string> loadSampleFile(const std::string &sampleFileAddr) {
@@ -470,6 +608,57 @@ std::vector<std::string> loadSampleFile(const std::string &sampleFileAddr) {
     return sampleNames;
 }
 
+/* Queries the sequences of ipfile with one thread per worker and writes the
+ * results to opfile in input order. The threads take the sequences of a batch
+ * one at a time, so long and short sequences even out. Only one batch of
+ * sequences and results is held in memory. */
+static uint64_t query_in_batches(std::istream &ipfile,
+                                 std::vector<std::unique_ptr<QueryWorker>> &workers,
+                                 CQF<KeyObject> &cqf,
+                                 std::vector<std::string> &sampleNames,
+                                 bool use_json, std::ostream &opfile) {
+    const uint64_t batchSize = 1024 * workers.size();
+    std::vector<std::string> reads, results;
+    std::string read;
+    uint64_t numOfQueries{0};
+    while (true) {
+        reads.clear();
+        while (reads.size() < batchSize and ipfile >> read)
+            reads.push_back(read);
+        if (reads.empty())
+            break;
+        results.assign(reads.size(), std::string());
+
+        std::atomic<uint64_t> next{0};
+        auto queryBatch = [&](QueryWorker *worker) {
+            if (worker->numaNode >= 0)
+                mantis::numa::PinToNode(worker->numaNode);
+            std::ostringstream out;
+            for (uint64_t i; (i = next++) < reads.size(); ) {
+                out.str("");
+                // The sequences are numbered across threads.
+                worker->queryStats.cnt = numOfQueries + i;
+                query_sequence(reads[i], worker->mstQuery, cqf,
+                               worker->cache_lru, worker->rs,
+                               worker->queryStats, sampleNames, use_json,
+                               numOfQueries + i == 0, out);
+                results[i] = out.str();
+            }
+        };
+        std::vector<std::thread> threads;
+        for (uint64_t t = 1; t < workers.size(); t++)
+            threads.emplace_back(queryBatch, workers[t].get());
+        queryBatch(workers[0].get());
+        for (auto &t : threads)
+            t.join();
+
+        for (auto &res : results)
+            opfile << res;
+        numOfQueries += reads.size();
+    }
+    return numOfQueries;
+}
+
 /*
  * ===  FUNCTION  =============================================================
  *         Name:  main
@@ -478,84 +667,94 @@ std::vector<std::string> loadSampleFile(const std::string &sampleFileAddr) {
  */
 int mst_query_main(QueryOpts &opt) {
     uint32_t queryK = opt.k;
-    QueryStats queryStats;
+    uint32_t numThreads = std::max(opt.numThreads, (uint32_t)1);
 
     spdlog::logger *logger = opt.console.get();
+    check_index_version(opt.prefix, logger);
     std::string dbg_file(opt.prefix + mantis::CQF_FILE);
     std::string sample_file(opt.prefix + mantis::SAMPLEID_FILE);
 
     std::vector<std::string> sampleNames = loadSampleFile(sample_file);
-    queryStats.numSamples = sampleNames.size();
-    logger->info("Number of experiments: {}", queryStats.numSamples);
+    logger->info("Number of experiments: {}", sampleNames.size());
 
+    std::vector<uint32_t> numaNodes = interleave_index_memory(opt.numa,
+                                                              logger);
     logger->info("Loading cqf...");
-    CQF<KeyObject> cqf(dbg_file, CQF_FREAD);
+    // Huge pages need the CQF in anonymous memory. The page cache of most
+    // file systems only has normal pages, so it is read instead of mapped.
+    // Reading it also puts all of it under the interleave policy now, rather
+    // than wherever the query threads happen to fault it in.
+    qf_set_huge_pages(opt.huge_pages);
+    CQF<KeyObject> cqf(dbg_file, opt.huge_pages || !numaNodes.empty() ?
+                       CQF_FREAD : CQF_MMAP);
     auto indexK = cqf.keybits() / 2;
     if (queryK == 0) queryK = indexK;
     logger->info("Done loading cqf. k is {}", indexK);
+    if (opt.huge_pages)
+        logger->info("The cqf is in {} pages.", qf_pages_name(cqf.pages()));
 
     logger->info("Loading color classes...");
-    MSTQuery mstQuery(opt.prefix, indexK, queryK, queryStats.numSamples, logger);
+    auto index = std::make_shared<const MSTIndex>(opt.prefix, logger,
+                                                  opt.huge_pages);
+    if (!numaNodes.empty())
+        index->prefault();
+    std::vector<std::unique_ptr<QueryWorker>> workers;
+    for (uint32_t t = 0; t < numThreads; t++)
+        workers.emplace_back(new QueryWorker(index, indexK, queryK,
+                                             sampleNames.size(), logger));
+    place_workers(numaNodes, workers, logger);
     logger->info("Done Loading color classes. Total # of color classes is {}",
-                 mstQuery.parentbv.size() - 1);
+                 index->parentbv.size() - 1);
 
-    logger->info("Querying colored dbg.");
+    logger->info("Querying colored dbg with {} threads.", numThreads);
     std::ofstream opfile(opt.output);
-    LRUCacheMap cache_lru(100000);
-    RankScores rs(1);
     std::ifstream ipfile(opt.query_file);
     std::string read;
     uint64_t numOfQueries{0};
     CLI::AutoTimer timer{"query time ", CLI::Timer::Big};
     if (opt.process_in_bulk) {
+        MSTQuery &mstQuery = workers[0]->mstQuery;
+        QueryStats &queryStats = workers[0]->queryStats;
         while (ipfile >> read) {
             mstQuery.parseKmers(read, indexK);
             numOfQueries++;
         }
-        mstQuery.findSamples(cqf, cache_lru, &rs, queryStats);
+        mstQuery.findSamples(cqf, workers[0]->cache_lru, &workers[0]->rs,
+                             queryStats);
         ipfile.clear();
         ipfile.seekg(0, ios::beg);
         if (opt.use_json) {
             opfile << "[\n";
             while (ipfile >> read) {
-                output_results_json(read, mstQuery, opfile, sampleNames, queryStats, numOfQueries);
+                output_results_json(read, mstQuery, opfile, sampleNames,
+                                    queryStats, queryStats.cnt == 0);
             }
-            opfile << "]\n";
+            opfile << (numOfQueries ? "\n]\n" : "]\n");
         } else {
             while (ipfile >> read) {
                 output_results(read, mstQuery, opfile, sampleNames, queryStats);
             }
         }
     } else {
-        if (opt.use_json) {
+        if (opt.use_json)
             opfile << "[\n";
-            while (ipfile >> read) {
-                mstQuery.reset();
-                mstQuery.parseKmers(read, indexK);
-                mstQuery.findSamples(cqf, cache_lru, &rs, queryStats);
-                if (mstQuery.indexK == mstQuery.queryK)
-                    output_results_json(mstQuery, opfile, sampleNames, queryStats, numOfQueries);
-                else
-                    output_results_json(read, mstQuery, opfile, sampleNames, queryStats, numOfQueries);
-                numOfQueries++;
-            }
-            opfile << "]\n";
-        } else {
-            while (ipfile >> read) {
-                mstQuery.reset();
-                mstQuery.parseKmers(read, indexK);
-                mstQuery.findSamples(cqf, cache_lru, &rs, queryStats);
-                if (mstQuery.indexK == mstQuery.queryK)
-                    output_results(mstQuery, opfile, sampleNames, queryStats);
-                else
-                    output_results(read, mstQuery, opfile, sampleNames, queryStats);
-                numOfQueries++;
-            }
-        }
+        numOfQueries = query_in_batches(ipfile, workers, cqf, sampleNames,
+                                        opt.use_json, opfile);
+        if (opt.use_json)
+            opfile << (numOfQueries ? "\n]\n" : "]\n");
     }
     opfile.close();
     logger->info("Writing done.");
 
+    QueryStats queryStats;
+    for (auto &worker : workers) {
+        queryStats.cacheCntr += worker->queryStats.cacheCntr;
+        queryStats.noCacheCntr += worker->queryStats.noCacheCntr;
+        queryStats.totSel += worker->queryStats.totSel;
+        queryStats.selectTime += worker->queryStats.selectTime;
+        queryStats.totEqcls += worker->queryStats.totEqcls;
+        queryStats.rootedNonZero += worker->queryStats.rootedNonZero;
+    }
     logger->info("cache was used {} times and not used {} times",
                  queryStats.cacheCntr, queryStats.noCacheCntr);
     logger->info("total selects = {}, time per select = {}",
@@ -175,6 +175,7 @@ int query_main (QueryOpts& opt)
   }
 
   spdlog::logger* console = opt.console.get();
+	check_index_version(prefix, console);
 	console->info("Reading colored dbg from disk.");
 
 	std::string dbg_file(prefix + mantis::CQF_FILE);
@@ -182,13 +183,21 @@ int query_main (QueryOpts& opt)
 	std::vector<std::string> eqclass_files = mantis::fs::GetFilesExt(prefix.c_str(),
                                                                    mantis::EQCLASS_FILE);
 
+	// Only a CQF read into memory can get huge pages.
+	qf_set_huge_pages(opt.huge_pages);
 	ColoredDbg<SampleObject<CQF<KeyObject>*>, KeyObject> cdbg(dbg_file,
 																														eqclass_files,
 																														sample_file,
-																														MANTIS_DBG_IN_MEMORY);
+																														opt.huge_pages ?
+																														MANTIS_DBG_IN_MEMORY :
+																														MANTIS_DBG_ON_DISK,
+																														read_num_bv_buffer(prefix));
 	uint64_t kmer_size = cdbg.get_cqf()->keybits() / 2;
   console->info("Read colored dbg with {} k-mers and {} color classes",
                 cdbg.get_cqf()->dist_elts(), cdbg.get_num_bitvectors());
+	if (opt.huge_pages)
+		console->info("The CQF is in {} pages.",
+									qf_pages_name(cdbg.get_cqf()->pages()));
 
 	//cdbg.get_cqf()->dump_metadata(); 
 	//CQF<KeyObject> cqf(query_file, false);
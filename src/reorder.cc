@@ -0,0 +1,188 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  reorder.cc
+ *
+ *    Description:  Renumbers the color classes of an index so that the
+ *                  classes with the most k-mers get the smallest ids.
+ *
+ * ============================================================================
+ */
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <numeric>
+#include <algorithm>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sdsl/bit_vectors.hpp"
+
+#include "MantisFS.h"
+#include "ProgOpts.h"
+#include "gqf_cpp.h"
+#include "colorclasses.h"
+#include "mantisconfig.hpp"
+#include "util.h"
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  reorder_main
+ *  Description:  The build ranks the color classes by abundance only over the
+ *                sampled k-mers and numbers the rest in the order they are
+ *                found. This pass counts the k-mers of each class over the
+ *                whole dbg and renumbers the classes by that count. The eq
+ *                class id of a k-mer is stored as its count in the CQF, so
+ *                small ids for abundant classes take fewer slots.
+ * ============================================================================
+ */
+	int
+reorder_main ( ReorderOpts& opt )
+{
+	spdlog::logger* console = opt.console.get();
+	std::string prefix(opt.prefix);
+	if (prefix.back() != '/') {
+		prefix += '/';
+	}
+
+	check_index_version(prefix, console);
+
+	// The MST refers to the color classes by id.
+	if (mantis::fs::FileExists((prefix + mantis::PARENTBV_FILE).c_str())) {
+		console->error("The index in {} already has an MST. Reorder the color classes before building the MST.",
+									 prefix);
+		exit(1);
+	}
+
+	std::string dbg_file(prefix + mantis::CQF_FILE);
+	console->info("Reading colored dbg from disk.");
+	CQF<KeyObject> dbg(dbg_file, CQF_FREAD);
+
+	std::vector<std::string> eqclass_files =
+		mantis::fs::GetFilesExt(prefix.c_str(), mantis::EQCLASS_FILE);
+	std::map<int, std::string> sorted_files;
+	for (std::string file : eqclass_files) {
+		int id = std::stoi(first_part(last_part(file, '/'), '_'));
+		sorted_files[id] = file;
+	}
+	std::vector<HybridColorClasses> eqclasses;
+	eqclasses.reserve(sorted_files.size());
+	uint64_t num_eqclasses = 0;
+	for (auto file : sorted_files) {
+		eqclasses.emplace_back();
+		sdsl::load_from_file(eqclasses.back(), file.second);
+		num_eqclasses += eqclasses.back().size();
+	}
+	if (num_eqclasses == 0) {
+		console->error("No color classes found in {}", prefix);
+		exit(1);
+	}
+	uint64_t num_samples = eqclasses.front().num_samples();
+	uint64_t num_bv_buffer = read_num_bv_buffer(prefix);
+	console->info("Read colored dbg with {} k-mers and {} color classes",
+								dbg.dist_elts(), num_eqclasses);
+
+	// The number of k-mers in each color class.
+	std::vector<uint64_t> abundance(num_eqclasses + 1, 0);
+	for (auto it = dbg.begin(); !it.done(); ++it) {
+		uint64_t eq_id = it.get_cur_hash().count;
+		if (eq_id == 0 || eq_id > num_eqclasses) {
+			console->error("K-mer with an unknown eq class id {}", eq_id);
+			exit(1);
+		}
+		abundance[eq_id]++;
+	}
+
+	// order[i] is the old id of the class that gets the id i + 1. Classes
+	// with the same abundance keep their relative order.
+	std::vector<uint64_t> order(num_eqclasses);
+	std::iota(order.begin(), order.end(), 1);
+	std::stable_sort(order.begin(), order.end(),
+									 [&abundance](uint64_t a, uint64_t b) {
+										 return abundance[a] > abundance[b]; });
+	std::vector<uint64_t> new_ids(num_eqclasses + 1, 0);
+	uint64_t num_moved = 0;
+	for (uint64_t i = 0; i < num_eqclasses; i++) {
+		new_ids[order[i]] = i + 1;
+		if (order[i] != i + 1)
+			num_moved++;
+	}
+	if (num_moved == 0) {
+		console->info("The color classes are already in abundance order.");
+		return EXIT_SUCCESS;
+	}
+	console->info("{} of {} color classes get a new id.", num_moved,
+								num_eqclasses);
+
+	// Write the k-mers with their new ids into a new CQF. Smaller counts need
+	// fewer slots, so start from the smallest size that fits the slots used
+	// now and let the CQF grow if that is not enough.
+	uint64_t old_slots = dbg.occupied_slots();
+	uint64_t qbits = 6;
+	while ((1ULL << qbits) < dbg.numslots() && (1ULL << qbits) * 0.95 <
+				 old_slots)
+		qbits++;
+	CQF<KeyObject> new_dbg(qbits, dbg.keybits(), dbg.hash_mode(), dbg.seed());
+	new_dbg.set_auto_resize();
+	for (auto it = dbg.begin(); !it.done(); ++it) {
+		KeyObject cur = it.get_cur_hash();
+		if (new_dbg.insert(KeyObject(cur.key, 0, new_ids[cur.count]), QF_NO_LOCK
+											 | QF_KEY_IS_HASH) == QF_NO_SPACE) {
+			console->error("The CQF is full and auto resize failed.");
+			exit(1);
+		}
+	}
+	console->info("Slots used by the CQF: {} before and {} after reordering. CQF size: {} slots before and {} after.",
+								old_slots, new_dbg.occupied_slots(), dbg.numslots(),
+								new_dbg.numslots());
+
+	// Write the color classes in the new order, num_bv_buffer classes per file
+	// as in the build. Everything goes to temporary files first so the index
+	// is not left half rewritten if this fails.
+	std::vector<std::string> tmp_files;
+	std::vector<uint64_t> words((num_samples + 63) / 64);
+	for (uint64_t start = 0; start < num_eqclasses; start +=
+			 num_bv_buffer) {
+		uint64_t num_rows = std::min(num_bv_buffer, num_eqclasses - start);
+		sdsl::bit_vector rows(num_rows * num_samples, 0);
+		for (uint64_t i = 0; i < num_rows; i++) {
+			uint64_t old_idx = order[start + i] - 1;
+			eqclasses[old_idx / num_bv_buffer].get_words(old_idx % num_bv_buffer,
+																									 words.data());
+			for (uint64_t j = 0; j < num_samples; j += 64)
+				rows.set_int(i * num_samples + j, words[j / 64],
+										 std::min((uint64_t)64, num_samples - j));
+		}
+		HybridColorClasses classes(rows, num_samples);
+		std::string bv_file(prefix + std::to_string(tmp_files.size()) + "_" +
+												mantis::EQCLASS_FILE + ".tmp");
+		sdsl::store_to_file(classes, bv_file);
+		tmp_files.push_back(bv_file);
+	}
+	new_dbg.serialize(dbg_file + ".tmp");
+	tmp_files.push_back(dbg_file + ".tmp");
+
+	for (auto file : tmp_files) {
+		std::string final_file(file, 0, file.size() - 4);
+		if (rename(file.c_str(), final_file.c_str())) {
+			console->error("Could not replace {}", final_file);
+			exit(1);
+		}
+	}
+
+	// Keep the abundance distribution dumped by build -e in sync.
+	std::string dist_file(prefix + "eqclass_dist.lst");
+	if (mantis::fs::FileExists(dist_file.c_str())) {
+		std::ofstream tmpfile(dist_file);
+		for (uint64_t i = 0; i < num_eqclasses; i++)
+			tmpfile << i + 1 << " " << abundance[order[i]] << std::endl;
+		tmpfile.close();
+	}
+	console->info("Reordering done.");
+
+	return EXIT_SUCCESS;
+}				/* ----------  end of function reorder_main  ---------- */
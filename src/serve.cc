@@ -0,0 +1,375 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  serve.cc
+ *
+ *    Description:  Loads an MST index once and answers queries sent over a
+ *                  Unix domain socket or a localhost TCP port.
+ *
+ * ============================================================================
+ */
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "MantisFS.h"
+#include "MantisNuma.h"
+#include "ProgOpts.h"
+#include "mstQuery.h"
+
+// The socket file to remove when the server is stopped by a signal.
+static char socket_file[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+static void remove_socket_file(int sig) {
+	if (socket_file[0])
+		unlink(socket_file);
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+/* A queue of accepted connections that the workers take from. */
+class ConnectionQueue {
+	public:
+		void push(int fd) {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				fds.push_back(fd);
+			}
+			cv.notify_one();
+		}
+
+		int pop(void) {
+			std::unique_lock<std::mutex> lock(mutex);
+			cv.wait(lock, [this] { return !fds.empty(); });
+			int fd = fds.front();
+			fds.pop_front();
+			return fd;
+		}
+
+	private:
+		std::mutex mutex;
+		std::condition_variable cv;
+		std::deque<int> fds;
+};
+
+/* Reads a request from fd. A request ends at an empty line or when the client
+ * shuts down its side of the connection. Fails with ETIMEDOUT if the request
+ * isn't there in timeout seconds and with EMSGSIZE if it is longer than
+ * max_size bytes. A limit of 0 means none. */
+static bool read_request(int fd, std::string &request, uint64_t max_size,
+												 uint32_t timeout) {
+	char buf[1 << 16];
+	auto deadline = std::chrono::steady_clock::now() +
+		std::chrono::seconds(timeout);
+	while (true) {
+		int wait_ms = -1;
+		if (timeout > 0) {
+			wait_ms = std::chrono::duration_cast<std::chrono::milliseconds>(deadline -
+																																			std::chrono::steady_clock::now()).count();
+			if (wait_ms <= 0) {
+				errno = ETIMEDOUT;
+				return false;
+			}
+		}
+		struct pollfd pfd = {fd, POLLIN, 0};
+		int ret = poll(&pfd, 1, wait_ms);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return false;
+		if (ret == 0) {
+			errno = ETIMEDOUT;
+			return false;
+		}
+		ssize_t len = read(fd, buf, sizeof(buf));
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0)
+			return false;
+		if (len == 0)
+			return true;
+		uint64_t from = request.size() ? request.size() - 1 : 0;
+		request.append(buf, len);
+		if (request[0] == '\n') {
+			request.clear();
+			return true;
+		}
+		size_t end = request.find("\n\n", from);
+		if (end == std::string::npos)
+			end = request.find("\n\r\n", from);
+		if (end != std::string::npos) {
+			request.resize(end + 1);
+			return true;
+		}
+		if (max_size > 0 && request.size() > max_size) {
+			errno = EMSGSIZE;
+			return false;
+		}
+	}
+}
+
+/* Splits a request into sequences. Each FASTA record is one sequence, and
+ * outside of FASTA records every whitespace-separated word is a sequence, as
+ * in the query file of mantis query. */
+static std::vector<std::string> parse_sequences(const std::string &request) {
+	std::vector<std::string> seqs;
+	std::istringstream in(request);
+	std::string line;
+	bool in_record = false;
+	while (std::getline(in, line)) {
+		if (!line.empty() && line[0] == '>') {
+			seqs.emplace_back();
+			in_record = true;
+			continue;
+		}
+		std::istringstream words(line);
+		std::string word;
+		while (words >> word) {
+			if (in_record)
+				seqs.back() += word;
+			else
+				seqs.push_back(word);
+		}
+	}
+	return seqs;
+}
+
+static bool write_all(int fd, const std::string &buf) {
+	uint64_t done = 0;
+	while (done < buf.size()) {
+		ssize_t len = send(fd, buf.data() + done, buf.size() - done, MSG_NOSIGNAL);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0)
+			return false;
+		done += len;
+	}
+	return true;
+}
+
+static void serve_connections(ConnectionQueue *queue, QueryWorker *worker,
+															CQF<KeyObject> *cqf,
+															std::vector<std::string> *sampleNames,
+															const ServeOpts *opt, spdlog::logger *logger) {
+	if (worker->numaNode >= 0)
+		mantis::numa::PinToNode(worker->numaNode);
+	while (true) {
+		int fd = queue->pop();
+		auto start = std::chrono::steady_clock::now();
+		std::string request;
+		if (!read_request(fd, request, opt->max_request << 20, opt->timeout)) {
+			logger->warn("Couldn't read a request: {}", strerror(errno));
+			close(fd);
+			continue;
+		}
+		std::vector<std::string> seqs = parse_sequences(request);
+
+		std::ostringstream out;
+		worker->queryStats.cnt = 0;
+		if (opt->use_json)
+			out << "[\n";
+		for (uint64_t i = 0; i < seqs.size(); i++)
+			query_sequence(seqs[i], worker->mstQuery, *cqf, worker->cache_lru,
+										 worker->rs, worker->queryStats, *sampleNames, opt->use_json,
+										 i == 0, out);
+		if (opt->use_json)
+			out << (seqs.empty() ? "]\n" : "\n]\n");
+		if (!write_all(fd, out.str()))
+			logger->warn("Couldn't send the result of a request: {}",
+									 strerror(errno));
+		close(fd);
+
+		std::chrono::duration<double> secs = std::chrono::steady_clock::now() -
+			start;
+		logger->info("Answered {} sequences in {} s.", seqs.size(), secs.count());
+	}
+}
+
+static int listen_unix(const std::string &path, spdlog::logger *logger) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path)) {
+		logger->error("The socket path {} is too long.", path);
+		exit(1);
+	}
+	strcpy(addr.sun_path, path.c_str());
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		logger->error("Couldn't create a socket: {}", strerror(errno));
+		exit(1);
+	}
+	// Remove the socket of a server that is gone, but not a file that isn't a
+	// socket or a socket that a server is still listening on.
+	struct stat sb;
+	if (stat(path.c_str(), &sb) == 0) {
+		if (!S_ISSOCK(sb.st_mode) || connect(fd, (struct sockaddr *)&addr,
+																				 sizeof(addr)) == 0) {
+			logger->error("{} exists and is in use.", path);
+			exit(1);
+		}
+		unlink(path.c_str());
+		// The state of a socket after a failed connect is unspecified, so
+		// don't bind it.
+		close(fd);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0) {
+			logger->error("Couldn't create a socket: {}", strerror(errno));
+			exit(1);
+		}
+	}
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd,
+																																			 SOMAXCONN)
+			< 0) {
+		logger->error("Couldn't listen on {}: {}", path, strerror(errno));
+		exit(1);
+	}
+	strcpy(socket_file, path.c_str());
+	return fd;
+}
+
+static int listen_tcp(uint16_t port, spdlog::logger *logger) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		logger->error("Couldn't create a socket: {}", strerror(errno));
+		exit(1);
+	}
+	int one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	// Only local clients. The protocol has no authentication.
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd,
+																																			 SOMAXCONN)
+			< 0) {
+		logger->error("Couldn't listen on port {}: {}", port, strerror(errno));
+		exit(1);
+	}
+	return fd;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  serve_main
+ *  Description:  Loads the CQF and the MST of the index once and answers
+ *                query requests until it is killed. Each connection carries
+ *                one request, and the server closes it after the result.
+ * ============================================================================
+ */
+	int
+serve_main ( ServeOpts& opt )
+{
+	spdlog::logger *logger = opt.console.get();
+	std::string prefix(opt.prefix);
+	if (prefix.back() != '/') {
+		prefix += '/';
+	}
+	check_index_version(prefix, logger);
+	if (!mantis::fs::FileExists((prefix + mantis::PARENTBV_FILE).c_str())) {
+		logger->error("The index in {} has no MST. Run mantis mst first.", prefix);
+		exit(1);
+	}
+	if (opt.numThreads == 0)
+		opt.numThreads = 1;
+
+	std::vector<std::string> sampleNames = loadSampleFile(prefix +
+																												mantis::SAMPLEID_FILE);
+	logger->info("Number of experiments: {}", sampleNames.size());
+	std::vector<uint32_t> numa_nodes = interleave_index_memory(opt.numa,
+																														 logger);
+	std::string dbg_file(prefix + mantis::CQF_FILE);
+	qf_set_huge_pages(opt.huge_pages);
+	// Mapped pages would be placed by the workers that fault them in.
+	CQF<KeyObject> cqf(dbg_file, opt.huge_pages || !numa_nodes.empty() ?
+										 CQF_FREAD : CQF_MMAP);
+	if (opt.huge_pages)
+		logger->info("The CQF is in {} pages.", qf_pages_name(cqf.pages()));
+	uint32_t indexK = cqf.keybits() / 2;
+	uint32_t queryK = opt.k ? opt.k : indexK;
+	if (queryK < indexK) {
+		logger->error("k ({}) can't be smaller than the k of the index ({}).",
+									queryK, indexK);
+		exit(1);
+	}
+	auto index = std::make_shared<const MSTIndex>(prefix, logger,
+																								opt.huge_pages);
+	if (!numa_nodes.empty())
+		index->prefault();
+
+	std::vector<std::unique_ptr<QueryWorker>> workers;
+	for (uint32_t i = 0; i < opt.numThreads; i++)
+		workers.emplace_back(new QueryWorker(index, indexK, queryK,
+																				 sampleNames.size(), logger));
+	place_workers(numa_nodes, workers, logger);
+
+	int listen_fd;
+	if (!opt.socket_path.empty()) {
+		listen_fd = listen_unix(opt.socket_path, logger);
+		logger->info("Listening on {} with {} workers.", opt.socket_path,
+								 opt.numThreads);
+	} else {
+		listen_fd = listen_tcp(opt.port, logger);
+		logger->info("Listening on 127.0.0.1:{} with {} workers.", opt.port,
+								 opt.numThreads);
+	}
+	signal(SIGINT, remove_socket_file);
+	signal(SIGTERM, remove_socket_file);
+
+	ConnectionQueue queue;
+	std::vector<std::thread> threads;
+	for (auto &worker : workers)
+		threads.emplace_back(serve_connections, &queue, worker.get(), &cqf,
+												 &sampleNames, &opt, logger);
+
+	// At most one warning a second about failed accepts, so that a server out
+	// of fds doesn't flood the log.
+	auto last_warning = std::chrono::steady_clock::time_point();
+	uint64_t failed_accepts = 0;
+	while (true) {
+		int fd = accept(listen_fd, nullptr, nullptr);
+		if (fd < 0) {
+			int err = errno;
+			if (err == EINTR || err == ECONNABORTED)
+				continue;
+			failed_accepts++;
+			auto now = std::chrono::steady_clock::now();
+			if (now - last_warning >= std::chrono::seconds(1)) {
+				logger->warn("accept failed {} times: {}", failed_accepts,
+										 strerror(err));
+				last_warning = now;
+				failed_accepts = 0;
+			}
+			// Out of fds or memory. Accepting again at once fails the same way,
+			// so wait for the workers to close some connections.
+			if (err == EMFILE || err == ENFILE || err == ENOBUFS || err == ENOMEM)
+				std::this_thread::sleep_for(std::chrono::milliseconds(100));
+			continue;
+		}
+		queue.push(fd);
+	}
+
+	return EXIT_SUCCESS;
+}				/* ----------  end of function serve_main  ---------- */
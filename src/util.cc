@@ -1,4 +1,9 @@
+#include <unistd.h>
+
 #include "util.h"
+#include "json.hpp"
+#include "mantisconfig.hpp"
+#include "MantisFS.h"
 
 std::string last_part(std::string str, char c) {
 	uint64_t found = str.find_last_of(c);
@@ -10,6 +15,45 @@ std::string first_part(std::string str, char c) {
 	return str.substr(0, found);
 }
 
+uint64_t read_num_bv_buffer(std::string prefix) {
+	std::ifstream jfile(prefix + mantis::meta_file_name);
+	if (!jfile.is_open())
+		return mantis::NUM_BV_BUFFER;
+	nlohmann::json minfo = nlohmann::json::parse(jfile, nullptr, false);
+	if (minfo.is_discarded() || !minfo.count(mantis::NUM_BV_BUFFER_KEY))
+		return mantis::NUM_BV_BUFFER;
+	return minfo[mantis::NUM_BV_BUFFER_KEY].get<uint64_t>();
+}
+
+void check_index_version(std::string prefix, spdlog::logger* logger) {
+	// Index version 0 stored the color classes as RRR bit vectors, which
+	// the commands would not find and would take for an index without any.
+	if (!mantis::fs::GetFilesExt(prefix.c_str(), "eqclass_rrr.cls").empty()) {
+		logger->error("The index in {} stores its color classes in the format of index version 0. This mantis reads index version {}. Rebuild the index with mantis build.",
+									prefix, mantis::index_version);
+		exit(1);
+	}
+	std::ifstream jfile(prefix + mantis::meta_file_name);
+	if (!jfile.is_open())
+		return;
+	nlohmann::json minfo = nlohmann::json::parse(jfile, nullptr, false);
+	uint64_t version = 0;
+	if (!minfo.is_discarded() && minfo.count("index_version"))
+		version = minfo["index_version"].get<uint64_t>();
+	if (version != mantis::index_version) {
+		logger->error("The index in {} has index version {}. This mantis reads index version {}. Rebuild the index with mantis build.",
+									prefix, version, mantis::index_version);
+		exit(1);
+	}
+}
+
+uint64_t get_resident_bytes(void) {
+	std::ifstream statm("/proc/self/statm");
+	uint64_t size = 0, resident = 0;
+	statm >> size >> resident;
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
 /* Print elapsed time using the start and end timeval */
 void print_time_elapsed(std::string desc, struct timeval* start, struct
 												timeval* end)
@@ -5,8 +5,9 @@
 #include <sstream>
 #include "mstQuery.h"
 #include "ProgOpts.h"
+#include "colorclasses.h"
 
-typedef std::vector<sdsl::rrr_vector < 63>> eqvec;
+typedef std::vector<HybridColorClasses> eqvec;
 
 void loadEqs(spdlog::logger *logger, std::string prefix, eqvec &bvs) {
     std::vector<std::string> eqclass_files =
@@ -27,7 +28,7 @@ void loadEqs(spdlog::logger *logger, std::string prefix, eqvec &bvs) {
     bvs.reserve(eqclass_files.size());
         uint64_t accumTotalEqCls = 0;
         for (auto &eqfile : eqclass_files) {
-            sdsl::rrr_vector<63> bv;
+            HybridColorClasses bv;
             bvs.push_back(bv);
             sdsl::load_from_file(bvs.back(), eqfile);
         }
@@ -36,28 +37,20 @@ void loadEqs(spdlog::logger *logger, std::string prefix, eqvec &bvs) {
 
 std::vector<uint64_t> buildColor(eqvec &bvs,
                 uint64_t eqid,
-                uint64_t num_samples) {
+                uint64_t num_samples,
+                uint64_t num_bv_buffer) {
     std::vector<uint64_t> eq;
     eq.reserve(num_samples);
-    uint64_t i{0}, bitcnt{0};
-    uint64_t idx = eqid / mantis::NUM_BV_BUFFER;
-    uint64_t offset = eqid % mantis::NUM_BV_BUFFER;
-//std::cerr << eqid << " " << num_samples << " " << idx << " " << offset << "\n";
-    while (i<num_samples) {
-        bitcnt = std::min(num_samples - i, (uint64_t) 64);
-        uint64_t wrd = (bvs[idx]).get_int(offset * num_samples + i, bitcnt);
-        for (auto j=0; j < bitcnt; j++) {
-            if ((wrd >> j) & 0x01)
-                eq.push_back(i+j);
-        }
-        i += bitcnt;
-    }
+    uint64_t idx = eqid / num_bv_buffer;
+    uint64_t offset = eqid % num_bv_buffer;
+    bvs[idx].for_each_sample(offset, [&eq](uint64_t id) { eq.push_back(id); });
     return eq;
 }
 
 
 int validate_mst_main(MSTValidateOpts &opt) {
     spdlog::logger *logger = opt.console.get();
+    check_index_version(opt.prefix, logger);
     std::string dbg_file(opt.prefix + mantis::CQF_FILE);
     std::string sample_file(opt.prefix + mantis::SAMPLEID_FILE);
 
@@ -73,9 +66,10 @@ int validate_mst_main(MSTValidateOpts &opt) {
     logger->info("Loading color classes...");
     eqvec bvs;
     loadEqs(logger, opt.prefix, bvs);
+    uint64_t num_bv_buffer = read_num_bv_buffer(opt.prefix);
     uint64_t eqCount{0};
     for (auto &bv:bvs) {
-        eqCount += bv.size()/opt.numSamples;
+        eqCount += bv.size();
     }
     logger->info("Done Loading color classes."
                  "\n\t# of color classes: {}"
@@ -86,7 +80,7 @@ int validate_mst_main(MSTValidateOpts &opt) {
         nonstd::optional<uint64_t> dummy{nonstd::nullopt};
         std::vector<uint64_t> newEq = mstQuery.buildColor(idx, queryStats, &cache_lru, nullptr, dummy);
         cache_lru.emplace(idx, newEq);
-        std::vector<uint64_t> oldEq = buildColor(bvs, idx, opt.numSamples);
+        std::vector<uint64_t> oldEq = buildColor(bvs, idx, opt.numSamples, num_bv_buffer);
         if (newEq != oldEq) {
             std::cerr << "AAAAA! LOOOSER!!\n";
             std::cerr << "index=" << idx << "\n";
@@ -126,6 +126,7 @@ validate_main ( ValidateOpts& opt )
 	}
 
 	// Read the colored dBG
+	check_index_version(prefix, console);
 	console->info("Reading colored dbg from disk.");
 	std::string dbg_file(prefix + mantis::CQF_FILE);
 	std::string sample_file(prefix + mantis::SAMPLEID_FILE);
@@ -135,7 +136,8 @@ validate_main ( ValidateOpts& opt )
 	ColoredDbg<SampleObject<CQF<KeyObject>*>, KeyObject> cdbg(dbg_file,
 																														eqclass_files,
 																														sample_file,
-																														MANTIS_DBG_IN_MEMORY);
+																														MANTIS_DBG_IN_MEMORY,
+																														read_num_bv_buffer(prefix));
 
 	console->info("Read colored dbg with {} k-mers and {} color classes",
 								cdbg.get_cqf()->dist_elts(), cdbg.get_num_bitvectors());